@@ -1,16 +1,28 @@
-#include <set>
 #include <map>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
-#include <iomanip>
 #include <fmt/chrono.h>
-#include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <rapidjson/document.h>
 #include <rapidjson/filereadstream.h>
+#include <rapidjson/memorystream.h>
 #include <rapidjson/istreamwrapper.h>
 #include <rapidjson/schema.h>
 #include <rapidjson/reader.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/prettywriter.h>
 
 #include <arrow/io/file.h>
 
@@ -29,1482 +41,5029 @@ using parquet::Type;
 using parquet::schema::GroupNode;
 using parquet::schema::PrimitiveNode;
 
+// vector<bool> is bit packed, the BoolWriter needs a plain bool array
+struct bool_buffer
+{
+    std::unique_ptr<bool[]> values;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    void push_back(bool b)
+    {
+        if (count == capacity)
+        {
+            capacity = std::max<size_t>(64, capacity * 2);
+            std::unique_ptr<bool[]> grown(new bool[capacity]);
+            std::copy(values.get(), values.get() + count, grown.get());
+            values = std::move(grown);
+        }
+        values[count++] = b;
+    }
+    const bool *data() const { return values.get(); }
+    size_t size() const { return count; }
+    void clear() { count = 0; }
+    void truncate(size_t size) { count = std::min(count, size); }
+};
+
+// bump allocator for the string bytes of one column
+// blocks of the standard size are kept on reset so a steady stream of batches does not allocate
+struct string_arena
+{
+    static constexpr size_t block_size = 64 * 1024;
+
+    struct block
+    {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+    vector<block> blocks;
+    size_t current = 0;
+    size_t used = 0;
+    // bytes of all blocks
+    size_t reserved = 0;
+
+    const uint8_t *append(const char *str, size_t length)
+    {
+        while (current < blocks.size() && used + length > blocks[current].size)
+        {
+            current++;
+            used = 0;
+        }
+        if (current == blocks.size())
+        {
+            // values larger than a block get their own one
+            size_t size = std::max(block_size, length);
+            blocks.push_back({std::unique_ptr<uint8_t[]>(new uint8_t[size]), size});
+            reserved += size;
+            used = 0;
+        }
+        uint8_t *dest = blocks[current].data.get() + used;
+        std::memcpy(dest, str, length);
+        used += length;
+        return dest;
+    }
+    void clear()
+    {
+        // the own blocks of large values are freed, one huge string does not hold its memory for the rest of the run
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [](const block &b)
+                                    { return b.size > block_size; }),
+                     blocks.end());
+        reserved = blocks.size() * block_size;
+        current = 0;
+        used = 0;
+    }
+};
+
+// buffered levels and values of one leaf column
+// only the value buffer of the physical type is filled, all of them keep their memory between batches
+// so the column writers get pointers into them without copying
 struct column
 {
-    vector<uint8_t> bool_values;
+    bool_buffer bool_values;
     vector<int32_t> int32_values;
     vector<int64_t> int64_values;
     vector<double> double_values;
-    vector<string> string_values;
+    // ByteArray views into the string bytes stored in the arena
+    string_arena string_values;
     vector<parquet::ByteArray> byte_array_values;
     vector<parquet::FixedLenByteArray> fixed_len_byte_array;
     vector<int16_t> repetition_levels;
     vector<int16_t> definition_levels;
-};
-
-std::shared_ptr<GroupNode> *global_parquet_schema;
-map<string, int> *global_leaf_indices;
-parquet::RowGroupWriter *global_rg_writer;
-std::shared_ptr<parquet::ParquetFileWriter> *global_file_writer;
-uint64_t global_row_count;
-uint64_t global_total_row_count;
-uint64_t global_num_rows_per_row_group;
-vector<uint64_t> *global_buffered_values_estimate;
-uint64_t global_row_group_size;
-int16_t global_required_count;
-int16_t global_repeated_count;
-int16_t global_new_array_depth;
-column (*global_parquet_data)[];
-vector<string> *global_current_keys;
-vector<int> *global_found_keys;
-set<string> *global_defined_keys;
-map<string, set<string>> *global_def_keys_per_object;
-map<string, set<string>> *global_def_keys_per_object_individual;
-bool global_new_object;
-bool global_new_array;
-bool global_new_key;
-bool global_logs = false;
-ofstream *logfile;
 
-int rep_level()
-{
-    if (global_new_key)
+    // bytes allocated by the buffers, charged to the memory budget
+    size_t memoryBytes() const
     {
-        return 0;
+        return bool_values.capacity + int32_values.capacity() * sizeof(int32_t) + int64_values.capacity() * sizeof(int64_t) +
+               double_values.capacity() * sizeof(double) + string_values.reserved + byte_array_values.capacity() * sizeof(parquet::ByteArray) +
+               fixed_len_byte_array.capacity() * sizeof(parquet::FixedLenByteArray) + (repetition_levels.capacity() + definition_levels.capacity()) * sizeof(int16_t);
     }
-    if (global_new_array)
+    // number of values, only the buffer of the physical type has any
+    size_t valueCount() const
     {
-        return global_new_array_depth;
+        return bool_values.size() + int32_values.size() + int64_values.size() + double_values.size() +
+               byte_array_values.size() + fixed_len_byte_array.size();
     }
-    return global_repeated_count;
-}
-
-parquet::schema::NodePtr getFieldFromPath(vector<string> *current_keys)
-{
-    string key = (*current_keys).at(0);
-    int field_index = (*global_parquet_schema)->FieldIndex(key);
-    auto field = (*global_parquet_schema)->field(field_index);
-    if ((*current_keys).size() > 1)
+    // keep the first `levels` levels and `values` values, as recorded with valueCount when a row started
+    // the string bytes stay in the arena until the batch is cleared
+    void truncate(size_t levels, size_t values)
     {
-        for (int i = 1; i < (*current_keys).size(); i++)
-        {
-            if (field->is_group())
-            {
-                std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(field);
-                string new_key = (*current_keys).at(i);
-                int new_index = group_field->FieldIndex(new_key);
-                field = group_field->field(new_index);
-            }
-            else
-            {
-                break;
-            }
-        }
+        auto keep = [values](size_t size)
+        { return std::min(size, values); };
+        repetition_levels.resize(levels);
+        definition_levels.resize(levels);
+        bool_values.truncate(keep(bool_values.size()));
+        int32_values.resize(keep(int32_values.size()));
+        int64_values.resize(keep(int64_values.size()));
+        double_values.resize(keep(double_values.size()));
+        byte_array_values.resize(keep(byte_array_values.size()));
+        fixed_len_byte_array.resize(keep(fixed_len_byte_array.size()));
     }
-    return field;
-}
+};
 
-bool allFieldsInPathRequired(const vector<string> *current_keys)
+// how JSON values are appended to a leaf, decided once per leaf from its physical and logical type
+enum class value_kind : uint8_t
 {
-    string key = (*current_keys).at(0);
-    int field_index = (*global_parquet_schema)->FieldIndex(key);
-    auto field = (*global_parquet_schema)->field(field_index);
-    bool all_required = true;
-    if ((*current_keys).size() >= 1)
-    {
-        for (int i = 1; i < (*current_keys).size(); i++)
-        {
-            if (field->name() != "list" && field->name() != "element")
-            {
-                all_required = all_required && field->is_required();
-            }
-            if (field->is_group())
-            {
-                std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(field);
-                string key = (*current_keys).at(i);
-                int new_index = group_field->FieldIndex(key);
-                field = group_field->field(new_index);
-            }
-            else
-            {
-                // maybe not good, schould fail the parser probably?
-                return false;
-            }
-        }
-    }
-    return all_required && field->is_required();
-}
+    none,
+    boolean,
+    int32,
+    int64,
+    real,
+    date,
+    timestamp,
+    time,
+    string
+};
 
-void buildLeafIndexMap(parquet::schema::NodePtr node, map<string, int> *leaf_indices)
+// value of a leaf compared in the --where expression, in the representation of the column
+// dates, timestamps and times are given as strings and stored as the integer of the column
+struct where_literal
 {
-    if (node->is_group())
-    {
-        std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(node);
-        for (int i = 0; i < group_field->field_count(); i++)
-        {
-            buildLeafIndexMap(group_field->field(i), leaf_indices);
-        }
-    }
-    else
-    {
-        string leaf_path = node->path()->ToDotString();
-        (*leaf_indices)[leaf_path] = (*leaf_indices).size();
-    }
-}
+    bool is_integer = false;
+    int64_t integer = 0;
+    double real = 0;
+    string text;
+};
 
-struct MyHandler : public BaseReaderHandler<UTF8<>, MyHandler>
+enum class where_kind : uint8_t
 {
-    bool Null()
-    {
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
-        {
-            column_index = (*global_leaf_indices)[col];
-        }
+    compare,
+    in_list,
+    is_null,
+    is_not_null,
+    logical_and,
+    logical_or,
+    logical_not
+};
 
-        if (column_index < 0)
-        {
-            return false;
-        }
+// one node of the compiled --where expression, comparisons refer to a leaf outside of lists
+struct where_node
+{
+    where_kind kind = where_kind::compare;
+    int leaf = -1;
+    // orderings of the value against the literal that make a comparison true: 1 less, 2 equal, 4 greater
+    uint8_t accepted = 0;
+    vector<where_literal> literals;
+    vector<int> children;
+};
 
-        auto field = getFieldFromPath(global_current_keys);
-        // check if column is required or has type null
-        if (field->is_required() && !field->logical_type()->is_null())
-        {
-            return false;
-        }
+// SQL truth value of a node for the current row, pending while its leaves are not all known
+enum class truth : uint8_t
+{
+    no,
+    yes,
+    unknown,
+    pending
+};
 
-        (*global_parquet_data)[column_index].definition_levels.push_back(((*global_current_keys).size() - global_required_count) - 1);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
+// compiled form of one node of the parquet schema, built once in SetupParquetSchema
+// node ids are assigned in DFS pre-order, the root ("schema") has id 0
+struct schema_node
+{
+    string name;
+    // dot path like ColumnPath::ToDotString(), "" for the root
+    string path;
+    int parent = -1;
+    // number of keys on the path from the root
+    int depth = 0;
+    // definition level of a value at this node (non-required nodes on the path)
+    int16_t definition_level = 0;
+    bool is_group = false;
+    bool is_required = false;
+    bool is_repeated = false;
+    bool is_element = false;
+    bool parent_is_list = false;
+    // all nodes on the path (except list/element) are required
+    bool all_required = false;
+    bool path_required = true;
+    vector<int> children;
+    // children sorted by name for the key lookup
+    vector<pair<string, int>> children_by_name;
+    // position in the children of the parent
+    int ordinal = -1;
+    // ordinal of the child of the grandparent with the same name, -1 if there is none
+    int uncle_ordinal = -1;
+    // first bit of the children of a group in the presence bitsets, groups start at a new word
+    size_t child_bits = 0;
+    // number of nodes in the subtree, the subtree has the ids [id, id + subtree_size)
+    int subtree_size = 1;
+    // presence bits of the children of all groups in the subtree, starting at child_bits
+    size_t subtree_child_bits = 0;
+    // leaves that get a null value when this node is missing in an object, in column order
+    vector<int> missing_leaves;
+    // a required group below the node can make a missing subtree invalid, checkChildren decides
+    bool missing_needs_check = false;
+    // keys of the properties whose columns are not selected with --columns, sorted, their values are skipped
+    vector<string> skipped_children;
+    // comparisons of the --where expression on this leaf, evaluated when its value arrives
+    vector<int> where_comparisons;
+
+    // only set for leaves
+    int leaf_index = -1;
+    parquet::Type::type physical_type = parquet::Type::UNDEFINED;
+    bool logical_null = false;
+    value_kind kind = value_kind::none;
+    // resolution of timestamp and time leaves
+    int64_t units_per_second = 0;
+
+    // keywords of the JSON schema checked while shredding, compiled by compileValidation
+    // children that are required in an object, one bit per ordinal
+    vector<uint64_t> required_children;
+    // the type is a union with null, null values are valid
+    bool nullable = false;
+    // one of the bounds below is set
+    bool check_value = false;
+    // integer columns, inclusive
+    int64_t int_minimum = INT64_MIN;
+    int64_t int_maximum = INT64_MAX;
+    // number columns
+    double minimum = -HUGE_VAL;
+    double maximum = HUGE_VAL;
+    bool exclusive_minimum = false;
+    bool exclusive_maximum = false;
+    // characters of a string or items of an array
+    uint64_t min_length = 0;
+    uint64_t max_length = UINT64_MAX;
+    vector<string> enum_values;
+    // keys that are not in the properties are invalid instead of unknown columns
+    bool no_additional_properties = false;
+    // URI fragment of the subschema of the node, like #/items/properties/a, for the messages of failed keywords
+    string schema_pointer;
+};
 
-        if ((*global_current_keys).back() == "element")
-        {
-            global_new_array = false;
-        }
-        global_new_key = false;
-        return true;
+// bytes held by all running conversions: buffered rows, row groups being written and pending file output
+// while it is used up, shredders wait in waitForMemory for the bytes handed on to the writers
+struct memory_budget
+{
+    uint64_t limit = 0;
+    std::atomic<uint64_t> used{0};
+    // bytes of batches and file output handed on to a writer thread, it releases them without the shredder
+    std::atomic<uint64_t> handed_on{0};
+    std::mutex mutex;
+    std::condition_variable released;
+
+    void handOn(uint64_t bytes)
+    {
+        handed_on += bytes;
     }
-    bool Bool(bool b)
+    // handed on bytes were written or left out
+    void arrived(uint64_t bytes)
+    {
+        handed_on -= bytes;
+        notify();
+    }
+    // wake the waiting shredders to check the budget again
+    void notify()
     {
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
         {
-            column_index = (*global_leaf_indices)[col];
+            std::lock_guard<std::mutex> lock(mutex);
         }
+        released.notify_all();
+    }
+};
 
-        if (column_index < 0)
-        {
-            return false;
-        }
+// compiled schema and options of a conversion, read only and shared by all conversions using them
+struct conversion_settings
+{
+    std::shared_ptr<GroupNode> parquet_schema;
+    vector<schema_node> schema_nodes;
+    int num_columns = 0;
+    // only set when the generic validator is needed
+    SchemaDocument *json_schema = nullptr;
+    // the schema is checked by the handler while shredding, see compileValidation
+    bool inline_validation = false;
+    // the rows of a JSON (not NDJSON) input are the items of one array
+    bool rows_in_array = false;
+    std::shared_ptr<parquet::WriterProperties> writer_props;
+
+    uint64_t num_rows_per_row_group = 1000000;
+    uint64_t row_group_size = 1 * 1024 * 1024 * 1024;
+    uint64_t batch_size = 4096;
+    uint64_t batch_byte_size = 64 * 1024 * 1024;
+    int buffersize = 65536;
+    bool logs = false;
+    bool novalidate = false;
+    bool print_duration = false;
+    bool mmap_input = false;
+    bool insitu = false;
+    bool ndjson = false;
+    int threads = 1;
+    uint64_t chunk_size = 64 * 1024 * 1024;
+    bool pipeline = false;
+    int column_threads = 1;
+    // bytes of a single row after which its levels are written before the row ends
+    uint64_t row_flush_size = 64 * 1024 * 1024;
+    // NDJSON rows that fail are left out and written to the dead letters, see parseLines
+    bool dead_letter = false;
+    // only the columns selected with --columns are in the schema, see selectColumns
+    bool projection = false;
+    // rows are only kept if the --where expression is true for them, see compileWhere, empty without it
+    vector<where_node> where_nodes;
+    int where_root = -1;
+    // not set without --memory-limit
+    memory_budget *memory = nullptr;
+};
 
-        auto column_type = global_rg_writer->column(column_index)->type();
-        if (column_type != parquet::Type::BOOLEAN)
-        {
-            return false;
-        }
+// finished rows of a worker thread that are not written yet
+struct pending_batch
+{
+    vector<column> columns;
+    uint64_t rows;
+    // the levels behind the last finished row belong to a row that failed to parse
+    bool partial_row;
+    // the levels behind the last finished row belong to a row that continues in the next batch
+    bool row_continues = false;
+    // bytes of the batch charged to the memory budget, released when it is written
+    uint64_t charged_bytes = 0;
+};
 
-        (*global_parquet_data)[column_index].bool_values.push_back(b);
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
+// bounded queue of batches from the thread shredding the input to the thread encoding them
+// the columns of encoded batches come back cleared, so their buffers are reused
+struct batch_queue
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<pending_batch> full;
+    // charged_bytes of a free batch is the capacity its cleared buffers retain
+    vector<pending_batch> free;
+    size_t capacity = 2;
+    // no more batches follow
+    bool closed = false;
+    // a batch could not be written, the shredder stops
+    std::atomic<bool> failed{false};
+    // the writer waits for the batches of this queue, its shredder must not wait for memory
+    std::atomic<bool> awaited{false};
+};
 
-        if ((*global_current_keys).back() == "element")
+// threads encoding the columns of the batches of one conversion, started once and kept until it ends
+// run hands every helper each job, the calling thread takes part and returns when all tasks are done
+struct worker_pool
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    vector<std::thread> helpers;
+    std::function<void(int)> task;
+    int count = 0;
+    std::atomic<int> next{0};
+    // helpers that did not finish the current job yet
+    size_t busy = 0;
+    uint64_t job = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    worker_pool(int threads)
+    {
+        for (int t = 1; t < threads; t++)
         {
-            global_new_array = false;
+            helpers.emplace_back([this]()
+                                 {
+                uint64_t done = 0;
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true)
+                {
+                    changed.wait(lock, [&]() { return stopping || job != done; });
+                    if (stopping)
+                    {
+                        return;
+                    }
+                    done = job;
+                    lock.unlock();
+                    work();
+                    lock.lock();
+                    if (--busy == 0)
+                    {
+                        changed.notify_all();
+                    }
+                } });
         }
-        global_new_key = false;
-        return true;
     }
-    bool Int(int i)
+    ~worker_pool()
     {
-        // check column type -> might be small number but Int64
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
         {
-            column_index = (*global_leaf_indices)[col];
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
-
-        if (column_index < 0)
-        {
-            return false;
-        }
-
-        auto field = getFieldFromPath(global_current_keys);
-        if (field->logical_type()->is_nested())
+        changed.notify_all();
+        for (std::thread &helper : helpers)
         {
-            return false;
+            helper.join();
         }
-
-        auto column_type = global_rg_writer->column(column_index)->type();
-        // switch if type is DOUBLE
-        if (column_type == parquet::Type::DOUBLE)
+    }
+    void work()
+    {
+        for (int i = next++; i < count; i = next++)
         {
-            return Double(i);
+            try
+            {
+                task(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
         }
-
-        if (!field->logical_type()->is_int())
+    }
+    // run task(i) for every i in [0, count), the first exception of a task is rethrown
+    void run(int tasks, std::function<void(int)> job_task)
+    {
+        if (helpers.empty() || tasks <= 1)
         {
-            return false;
+            for (int i = 0; i < tasks; i++)
+            {
+                job_task(i);
+            }
+            return;
         }
-
-        // switch if type is INT64
-        if (column_type == parquet::Type::INT64)
         {
-            return Int64(i);
+            std::lock_guard<std::mutex> lock(mutex);
+            task = std::move(job_task);
+            count = tasks;
+            next = 0;
+            error = nullptr;
+            busy = helpers.size();
+            job++;
         }
-
-        (*global_parquet_data)[column_index].int32_values.push_back(i);
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
-
-        if ((*global_current_keys).back() == "element")
+        changed.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return busy == 0; });
+        if (error)
         {
-            global_new_array = false;
+            std::rethrow_exception(error);
         }
-        global_new_key = false;
-        return true;
     }
-    bool Uint(unsigned u)
+};
+
+// state of one conversion: the file writer and the buffers of the handler
+// every conversion, and every worker shredding a chunk of one, has its own context
+struct conversion_context
+{
+    const conversion_settings *settings;
+
+    std::shared_ptr<parquet::ParquetFileWriter> file_writer;
+    parquet::RowGroupWriter *rg_writer = nullptr;
+    uint64_t row_count = 0;
+    uint64_t total_row_count = 0;
+    vector<uint64_t> buffered_values_estimate;
+
+    vector<column> parquet_data;
+    uint64_t batch_rows = 0;
+    uint64_t batch_bytes = 0;
+    // bytes of the batch and of the current row group charged to the memory budget
+    uint64_t charged_batch_bytes = 0;
+    uint64_t charged_row_group_bytes = 0;
+    // batch bytes before the current row started
+    uint64_t row_begin_bytes = 0;
+    // levels and values of each column before the current row started, only kept when rows can be taken out again
+    vector<size_t> row_begin_levels;
+    vector<size_t> row_begin_values;
+    // a row is partly written to the row group, per column whether it has levels of that row
+    bool writer_row_open = false;
+    vector<char> column_row_open;
+    // a row that failed to parse was partly written, the file only stays readable without it
+    bool broken_row_written = false;
+    // levels of the current row were handed on with row_continues, the row can not be taken back any more
+    bool row_flushed = false;
+    // a batch could not be written, the conversion has to stop
+    bool write_failed = false;
+    int16_t repeated_count = 0;
+    int16_t new_array_depth = 0;
+    int current_node = 0;
+    // leaves found in the current row are stamped with the number of the row
+    vector<uint64_t> found_leaves;
+    uint64_t row_stamp = 1;
+    // nodes defined in the current row, one bit per node id
+    vector<uint64_t> defined_nodes;
+    // children defined in the current object of each group, one bit per child at schema_node::child_bits
+    vector<uint64_t> defined_children;
+    // children that appeared as key in the current object of each group
+    vector<uint64_t> keyed_children;
+    bool new_object = false;
+    bool new_array = false;
+    bool new_key = false;
+    // set when the batches are encoded on a separate thread, or written by the context owning the file writer while a worker shreds a chunk
+    batch_queue *queue = nullptr;
+    // set with column_threads on the context owning the file writer
+    worker_pool *pool = nullptr;
+
+    conversion_context(const conversion_settings *conversion)
+        : settings(conversion),
+          buffered_values_estimate(conversion->num_columns, 0),
+          parquet_data(conversion->num_columns),
+          column_row_open(conversion->num_columns, 0),
+          found_leaves(conversion->num_columns, 0),
+          defined_nodes((conversion->schema_nodes.size() + 63) / 64, 0)
     {
-        // be careful with type (IntType(size, bool_signed))
-        // check column type -> might be small number but Int64
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
+        if (conversion->dead_letter || conversion->where_root >= 0)
         {
-            column_index = (*global_leaf_indices)[col];
+            row_begin_levels.assign(conversion->num_columns, 0);
+            row_begin_values.assign(conversion->num_columns, 0);
         }
-
-        if (column_index < 0)
+        size_t child_bits = 0;
+        for (const schema_node &node : conversion->schema_nodes)
         {
-            return false;
+            child_bits = std::max(child_bits, node.child_bits + node.children.size());
         }
+        defined_children.assign((child_bits + 63) / 64, 0);
+        keyed_children.assign((child_bits + 63) / 64, 0);
+    }
+};
 
-        auto field = getFieldFromPath(global_current_keys);
-        if (field->logical_type()->is_nested())
-        {
-            return false;
-        }
+ofstream *logfile;
+std::mutex log_mutex;
 
-        auto column_type = global_rg_writer->column(column_index)->type();
-        // switch if type is DOUBLE
-        if (column_type == parquet::Type::DOUBLE)
-        {
-            return Double(u);
-        }
+// print a log line and append it to the log file, lines of concurrent threads are not interleaved
+void printLog(const string &log)
+{
+    std::lock_guard<std::mutex> lock(log_mutex);
+    fmt::print(log);
+    if (logfile->is_open())
+    {
+        (*logfile) << log;
+    }
+}
 
-        if (!field->logical_type()->is_int())
+// set the bytes charged to the memory budget for one buffer, `charged` holds the bytes charged so far
+void chargeMemory(const conversion_settings *settings, uint64_t *charged, uint64_t bytes)
+{
+    if (settings->memory != nullptr && *charged != bytes)
+    {
+        bool less = bytes < *charged;
+        settings->memory->used += bytes - *charged;
+        *charged = bytes;
+        if (less)
         {
-            return false;
+            settings->memory->notify();
         }
+    }
+}
 
-        // switch if type is INT64
-        if (column_type == parquet::Type::INT64)
-        {
-            return Uint64(u);
-        }
+// bytes allocated by the buffers of a batch
+uint64_t batchMemory(const vector<column> &columns)
+{
+    uint64_t bytes = 0;
+    for (const column &col : columns)
+    {
+        bytes += col.memoryBytes();
+    }
+    return bytes;
+}
 
-        (*global_parquet_data)[column_index].int32_values.push_back(u);
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
+bool memoryExceeded(const conversion_settings *settings)
+{
+    return settings->memory != nullptr && settings->memory->used > settings->memory->limit;
+}
 
-        if ((*global_current_keys).back() == "element")
+// days since 01.01.1970 of the YYYY-M-D date of a string that was no YYYY-MM-DD, single digit months and days are accepted
+// nothing may follow the date
+bool parseShortDate(const char *str, SizeType length, int32_t *days)
+{
+    SizeType pos = 0;
+    // at most `max_digits` digits, at least one
+    auto number = [&](SizeType max_digits, unsigned *value)
+    {
+        SizeType begin = pos;
+        *value = 0;
+        while (pos < length && pos - begin < max_digits && str[pos] >= '0' && str[pos] <= '9')
         {
-            global_new_array = false;
+            *value = *value * 10 + (str[pos++] - '0');
         }
-        global_new_key = false;
-        return true;
+        return pos > begin;
+    };
+    unsigned year, month, day;
+    if (!number(4, &year) || pos != 4 || pos >= length || str[pos++] != '-' || !number(2, &month) ||
+        pos >= length || str[pos++] != '-' || !number(2, &day) || pos != length)
+    {
+        return false;
     }
-    bool Int64(int64_t i)
+    date::year_month_day ymd{date::year{int(year)}, date::month{month}, date::day{day}};
+    if (!ymd.ok())
     {
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
-        {
-            column_index = (*global_leaf_indices)[col];
-        }
-
-        if (column_index < 0)
-        {
-            return false;
-        }
+        return false;
+    }
+    *days = date::sys_days(ymd).time_since_epoch().count();
+    return true;
+}
 
-        auto field = getFieldFromPath(global_current_keys);
+// days since 01.01.1970 of a date string starting with YYYY-MM-DD, independent of the timezone
+// months and days may have a single digit, like with the former %Y-%m-%d, then nothing may follow
+// characters behind a YYYY-MM-DD date are ignored, false if it is no valid calendar date
+bool parseDate(const char *str, SizeType length, int32_t *days)
+{
+    if (length < 10 || str[4] != '-' || str[7] != '-')
+    {
+        return parseShortDate(str, length, days);
+    }
+    // the eight digits are checked at once, each byte needs 0x3 as high and at most 9 as low nibble
+    const char packed[8] = {str[0], str[1], str[2], str[3], str[5], str[6], str[8], str[9]};
+    uint64_t digits;
+    memcpy(&digits, packed, sizeof(digits));
+    if ((digits & 0xF0F0F0F0F0F0F0F0) != 0x3030303030303030 ||
+        ((digits + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) != 0x3030303030303030)
+    {
+        // like 2021-12-1 followed by other characters
+        return parseShortDate(str, length, days);
+    }
+    int year = (str[0] - '0') * 1000 + (str[1] - '0') * 100 + (str[2] - '0') * 10 + (str[3] - '0');
+    unsigned month = (str[5] - '0') * 10 + (str[6] - '0');
+    unsigned day = (str[8] - '0') * 10 + (str[9] - '0');
+    date::year_month_day ymd{date::year{year}, date::month{month}, date::day{day}};
+    if (!ymd.ok())
+    {
+        return false;
+    }
+    *days = date::sys_days(ymd).time_since_epoch().count();
+    return true;
+}
 
-        if (field->logical_type()->is_nested())
-        {
-            return false;
-        }
+// time of an RFC 3339 full-time HH:MM:SS[.fraction](Z|+HH:MM|-HH:MM) in 1/units_per_second seconds
+// the offset is applied, so the time is in UTC and may lie before 00:00 or after 24:00
+bool parseTime(const char *str, SizeType length, int64_t units_per_second, int64_t *time)
+{
+    if (length < 9 || str[2] != ':' || str[5] != ':')
+    {
+        return false;
+    }
+    const char packed[8] = {str[0], str[1], str[3], str[4], str[6], str[7], '0', '0'};
+    uint64_t digits;
+    memcpy(&digits, packed, sizeof(digits));
+    if ((digits & 0xF0F0F0F0F0F0F0F0) != 0x3030303030303030 ||
+        ((digits + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) != 0x3030303030303030)
+    {
+        return false;
+    }
+    int hour = (str[0] - '0') * 10 + (str[1] - '0');
+    int minute = (str[3] - '0') * 10 + (str[4] - '0');
+    int second = (str[6] - '0') * 10 + (str[7] - '0');
+    // second 60 is a leap second
+    if (hour > 23 || minute > 59 || second > 60)
+    {
+        return false;
+    }
 
-        // switch if type is DOUBLE
-        if (global_rg_writer->column(column_index)->type() == parquet::Type::DOUBLE)
+    SizeType pos = 8;
+    int64_t fraction = 0;
+    if (str[pos] == '.')
+    {
+        // digits finer than the unit are cut off
+        int64_t scale = units_per_second;
+        SizeType first_digit = ++pos;
+        while (pos < length && str[pos] >= '0' && str[pos] <= '9')
         {
-            return Double(i);
+            scale /= 10;
+            fraction += (str[pos] - '0') * scale;
+            pos++;
         }
-
-        if (!field->logical_type()->is_int())
+        if (pos == first_digit)
         {
             return false;
         }
+    }
 
-        (*global_parquet_data)[column_index].int64_values.push_back(i);
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
-
-        string last_key = (*global_current_keys)[-1];
-        if ((*global_current_keys).back() == "element")
-        {
-            global_new_array = false;
-        }
-        global_new_key = false;
-        return true;
+    int offset = 0;
+    if (pos + 1 == length && (str[pos] == 'Z' || str[pos] == 'z'))
+    {
+        pos++;
     }
-    bool Uint64(uint64_t u)
+    else if (pos + 6 == length && (str[pos] == '+' || str[pos] == '-') && str[pos + 3] == ':')
     {
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
-        {
-            column_index = (*global_leaf_indices)[col];
-        }
-
-        if (column_index < 0)
+        for (SizeType i : {pos + 1, pos + 2, pos + 4, pos + 5})
         {
-            return false;
+            if (str[i] < '0' || str[i] > '9')
+            {
+                return false;
+            }
         }
-
-        auto field = getFieldFromPath(global_current_keys);
-
-        if (field->logical_type()->is_nested())
+        int offset_hour = (str[pos + 1] - '0') * 10 + (str[pos + 2] - '0');
+        int offset_minute = (str[pos + 4] - '0') * 10 + (str[pos + 5] - '0');
+        if (offset_hour > 23 || offset_minute > 59)
         {
             return false;
         }
-
-        // switch if type is DOUBLE
-        if (global_rg_writer->column(column_index)->type() == parquet::Type::DOUBLE)
-        {
-            return Double(u);
-        }
-
-        if (!field->logical_type()->is_int())
+        offset = (offset_hour * 60 + offset_minute) * 60;
+        if (str[pos] == '-')
         {
-            return false;
+            offset = -offset;
         }
+        pos += 6;
+    }
+    else
+    {
+        return false;
+    }
+    // local time = UTC + offset
+    *time = (int64_t((hour * 60 + minute) * 60 + second) - offset) * units_per_second + fraction;
+    return true;
+}
 
-        (*global_parquet_data)[column_index].int64_values.push_back(u);
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
+// time since 1970-01-01T00:00:00Z of an RFC 3339 date-time YYYY-MM-DDTHH:MM:SS[.fraction](Z|+HH:MM|-HH:MM)
+// in 1/units_per_second seconds, false if it is invalid or does not fit into 64 bits
+bool parseTimestamp(const char *str, SizeType length, int64_t units_per_second, int64_t *timestamp)
+{
+    int32_t days;
+    int64_t time;
+    // the date of a date-time always has two digit months and days
+    if (length < 11 || str[4] != '-' || str[7] != '-' || (str[10] != 'T' && str[10] != 't' && str[10] != ' ') ||
+        !parseDate(str, length, &days) || !parseTime(str + 11, length - 11, units_per_second, &time))
+    {
+        return false;
+    }
+    // in nanoseconds only the years 1677 to 2262 fit
+    return !__builtin_mul_overflow(int64_t(days), 24 * 60 * 60 * units_per_second, timestamp) &&
+           !__builtin_add_overflow(*timestamp, time, timestamp);
+}
 
-        if ((*global_current_keys).back() == "element")
-        {
-            global_new_array = false;
-        }
-        global_new_key = false;
-        return true;
+int64_t unitsPerSecond(parquet::LogicalType::TimeUnit::unit unit)
+{
+    switch (unit)
+    {
+    case parquet::LogicalType::TimeUnit::MILLIS:
+        return 1000;
+    case parquet::LogicalType::TimeUnit::MICROS:
+        return 1000000;
+    default:
+        return 1000000000;
     }
-    bool Double(double d)
+}
+
+int rep_level(const conversion_context *ctx)
+{
+    if (ctx->new_key)
     {
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
-        {
-            column_index = (*global_leaf_indices)[col];
-        }
+        return 0;
+    }
+    if (ctx->new_array)
+    {
+        return ctx->new_array_depth;
+    }
+    return ctx->repeated_count;
+}
 
-        if (column_index < 0)
-        {
-            return false;
-        }
+int findChild(const vector<schema_node> &nodes, int node_id, const char *str, SizeType length)
+{
+    const vector<pair<string, int>> &children = nodes[node_id].children_by_name;
+    string_view key(str, length);
+    auto it = std::lower_bound(children.begin(), children.end(), key,
+                               [](const pair<string, int> &child, string_view k)
+                               { return string_view(child.first) < k; });
+    if (it == children.end() || string_view(it->first) != key)
+    {
+        return -1;
+    }
+    return it->second;
+}
 
-        auto field = getFieldFromPath(global_current_keys);
-        if (field->logical_type()->is_nested())
-        {
-            return false;
-        }
-        if (global_rg_writer->column(column_index)->type() != parquet::Type::DOUBLE)
-        {
-            return false;
-        }
+bool testBit(const vector<uint64_t> &bits, size_t index)
+{
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
 
-        (*global_parquet_data)[column_index].double_values.push_back(d);
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
+void setBit(vector<uint64_t> &bits, size_t index)
+{
+    bits[index / 64] |= uint64_t(1) << (index % 64);
+}
 
-        if ((*global_current_keys).back() == "element")
-        {
-            global_new_array = false;
-        }
-        global_new_key = false;
-        return true;
+void setBits(vector<uint64_t> &bits, size_t first, size_t count)
+{
+    for (size_t index = first; index < first + count;)
+    {
+        size_t bit = index % 64;
+        size_t n = std::min<size_t>(64 - bit, first + count - index);
+        bits[index / 64] |= (n == 64 ? ~uint64_t(0) : ((uint64_t(1) << n) - 1)) << bit;
+        index += n;
     }
-    bool String(const char *str, SizeType length, bool copy)
+}
+
+// forget the children of a group that were defined in its current object
+void clearChildren(vector<uint64_t> &bits, const schema_node &node)
+{
+    std::fill(bits.begin() + node.child_bits / 64, bits.begin() + (node.child_bits + node.children.size() + 63) / 64, 0);
+}
+
+int compileSchemaNode(parquet::schema::NodePtr node, int parent, vector<schema_node> *nodes, int *leaf_count, size_t *child_bits)
+{
+    int id = (*nodes).size();
+    (*nodes).emplace_back();
+    schema_node compiled;
+    compiled.name = node->name();
+    compiled.parent = parent;
+    compiled.is_group = node->is_group();
+    compiled.is_required = node->is_required();
+    compiled.is_repeated = node->is_repeated();
+    compiled.is_element = compiled.name == "element";
+    if (parent >= 0)
     {
-        // String should also contain/differ between other types and normal string
-        // date, transform into INT32
-        // timestamp, transform into INT64
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        int column_index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
-        {
-            column_index = (*global_leaf_indices)[col];
-        }
+        const schema_node &parent_node = (*nodes)[parent];
+        compiled.path = parent_node.depth > 0 ? parent_node.path + "." + compiled.name : compiled.name;
+        compiled.depth = parent_node.depth + 1;
+        compiled.definition_level = parent_node.definition_level + (compiled.is_required ? 0 : 1);
+        compiled.parent_is_list = parent_node.name == "list";
+        // list and element nodes on the path are ignored, the node itself always counts
+        compiled.all_required = parent_node.path_required && compiled.is_required;
+        compiled.path_required = parent_node.path_required && (compiled.is_required || compiled.name == "list" || compiled.is_element);
+    }
 
-        if (column_index < 0)
+    if (node->is_group())
+    {
+        std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(node);
+        compiled.child_bits = *child_bits;
+        *child_bits += (group_field->field_count() + 63) / 64 * 64;
+        (*nodes)[id] = compiled;
+        for (int i = 0; i < group_field->field_count(); i++)
         {
-            return false;
+            int child = compileSchemaNode(group_field->field(i), id, nodes, leaf_count, child_bits);
+            (*nodes)[child].ordinal = i;
+            (*nodes)[id].children.push_back(child);
+            (*nodes)[id].children_by_name.push_back({group_field->field(i)->name(), child});
         }
-
-        auto field = getFieldFromPath(global_current_keys);
-
-        if (field->logical_type()->is_date())
+        std::sort((*nodes)[id].children_by_name.begin(), (*nodes)[id].children_by_name.end());
+        // required grandchildren are looked up by name among the children of this node
+        for (int child : (*nodes)[id].children)
         {
-            // transform string into INT32 (num of days from unix epoch, 01.01.1970)
-            tm time = {};
-            istringstream ss(str);
-            ss >> get_time(&time, "%Y-%m-%d");
-            if (ss.fail())
+            for (int grandchild : (*nodes)[child].children)
             {
-                return false;
+                const string &name = (*nodes)[grandchild].name;
+                int uncle = findChild(*nodes, id, name.c_str(), name.size());
+                (*nodes)[grandchild].uncle_ordinal = uncle >= 0 ? (*nodes)[uncle].ordinal : -1;
             }
-            time_t date = mktime(&time);
-            int32_t daysSinceEpoch = date / (60 * 60 * 24);
-            (*global_parquet_data)[column_index].int32_values.push_back(daysSinceEpoch + 1);
         }
-        else
+        schema_node &group = (*nodes)[id];
+        group.subtree_size = (*nodes).size() - id;
+        group.subtree_child_bits = *child_bits - group.child_bits;
+        for (int descendant = id + 1; descendant < id + group.subtree_size; descendant++)
         {
-            // default
-            if (!field->logical_type()->is_string())
+            const schema_node &descendant_node = (*nodes)[descendant];
+            if (!descendant_node.is_group)
             {
-                return false;
+                group.missing_leaves.push_back(descendant);
+                continue;
+            }
+            bool required_child = false;
+            for (int child : descendant_node.children)
+            {
+                required_child = required_child || (*nodes)[child].is_required;
+            }
+            if ((*nodes)[descendant_node.parent].is_required && (descendant_node.is_required || required_child))
+            {
+                group.missing_needs_check = true;
             }
-            (*global_parquet_data)[column_index].string_values.push_back(str);
         }
+        return id;
+    }
 
-        (*global_parquet_data)[column_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
+    std::shared_ptr<PrimitiveNode> primitive = std::static_pointer_cast<PrimitiveNode>(node);
+    compiled.leaf_index = (*leaf_count)++;
+    compiled.physical_type = primitive->physical_type();
+    compiled.logical_null = node->logical_type()->is_null();
+    const std::shared_ptr<const parquet::LogicalType> &logical_type = node->logical_type();
+    if (compiled.physical_type == parquet::Type::BOOLEAN)
+    {
+        compiled.kind = value_kind::boolean;
+    }
+    else if (compiled.physical_type == parquet::Type::DOUBLE)
+    {
+        compiled.kind = value_kind::real;
+    }
+    else if (logical_type->is_int())
+    {
+        compiled.kind = compiled.physical_type == parquet::Type::INT64 ? value_kind::int64 : value_kind::int32;
+    }
+    else if (logical_type->is_date())
+    {
+        compiled.kind = value_kind::date;
+    }
+    else if (logical_type->is_timestamp())
+    {
+        compiled.kind = value_kind::timestamp;
+        compiled.units_per_second = unitsPerSecond(static_cast<const parquet::TimestampLogicalType &>(*logical_type).time_unit());
+    }
+    else if (logical_type->is_time())
+    {
+        compiled.kind = value_kind::time;
+        compiled.units_per_second = unitsPerSecond(static_cast<const parquet::TimeLogicalType &>(*logical_type).time_unit());
+    }
+    else if (logical_type->is_string())
+    {
+        compiled.kind = value_kind::string;
+    }
+    compiled.missing_leaves.push_back(id);
+    (*nodes)[id] = compiled;
+    return id;
+}
 
-        if ((*global_current_keys).back() == "element")
+// end of the levels in the column buffer that belong to the next `rows` rows starting at level `begin`
+// every row starts with exactly one repetition level 0 in each column
+size_t completeRowLevels(const column &col, size_t begin, uint64_t rows)
+{
+    uint64_t row_starts = 0;
+    for (size_t i = begin; i < col.repetition_levels.size(); i++)
+    {
+        if (col.repetition_levels[i] == 0)
         {
-            global_new_array = false;
+            if (row_starts == rows)
+            {
+                return i;
+            }
+            row_starts++;
         }
-        global_new_key = false;
-        return true;
     }
-    bool StartObject()
-    {
-        global_new_object = true;
+    return col.repetition_levels.size();
+}
 
-        return true;
-    }
-    bool Key(const char *str, SizeType length, bool copy)
+// run task(i) for every i in [0, count) on up to `threads` threads, the calling thread included
+// the first exception of a task is rethrown when all threads are done
+template <typename Task>
+void parallelFor(int count, int threads, Task task)
+{
+    if (threads <= 1 || count <= 1)
     {
-        string prev_path = boost::algorithm::join((*global_current_keys), ".");
-        if (global_new_object)
+        for (int i = 0; i < count; i++)
         {
-            global_new_object = false;
+            task(i);
         }
-        else
+        return;
+    }
+    std::atomic<int> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto run = [&]()
+    {
+        for (int i = next++; i < count; i = next++)
         {
-            auto prev_field = getFieldFromPath(global_current_keys);
-            if (prev_field->path()->ToDotString() != prev_path)
+            try
             {
-                // fail parser if field not found
-                return false;
+                task(i);
             }
-
-            if (prev_field->is_required())
+            catch (...)
             {
-                global_required_count--;
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
             }
-            (*global_current_keys).pop_back();
         }
+    };
+    vector<std::thread> helpers;
+    for (int t = 1; t < std::min(threads, count); t++)
+    {
+        helpers.emplace_back(run);
+    }
+    run();
+    for (std::thread &helper : helpers)
+    {
+        helper.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
 
-        string parent = boost::algorithm::join((*global_current_keys), ".");
-        (*global_def_keys_per_object)[parent].emplace(str);
-        (*global_def_keys_per_object_individual)[parent].emplace(str);
+// write `length` levels of the column buffer and their values from `value_offset` on
+// returns the estimated bytes of the values buffered in the column writer
+int64_t writeColumn(parquet::ColumnWriter *column_writer, column &row_data, const int16_t *def_levels, const int16_t *rep_levels, int64_t length, size_t value_offset)
+{
+    switch (column_writer->type())
+    {
+    case parquet::Type::BOOLEAN:
+    {
+        parquet::BoolWriter *bool_writer = static_cast<parquet::BoolWriter *>(column_writer);
+        bool_writer->WriteBatch(length, def_levels, rep_levels, row_data.bool_values.data() + value_offset);
+        return bool_writer->estimated_buffered_value_bytes();
+    }
+    case parquet::Type::INT32:
+    {
+        parquet::Int32Writer *int32_writer = static_cast<parquet::Int32Writer *>(column_writer);
+        int32_writer->WriteBatch(length, def_levels, rep_levels, row_data.int32_values.data() + value_offset);
+        return int32_writer->estimated_buffered_value_bytes();
+    }
+    case parquet::Type::INT64:
+    {
+        parquet::Int64Writer *int64_writer = static_cast<parquet::Int64Writer *>(column_writer);
+        int64_writer->WriteBatch(length, def_levels, rep_levels, row_data.int64_values.data() + value_offset);
+        return int64_writer->estimated_buffered_value_bytes();
+    }
+    case parquet::Type::DOUBLE:
+    {
+        parquet::DoubleWriter *double_writer = static_cast<parquet::DoubleWriter *>(column_writer);
+        double_writer->WriteBatch(length, def_levels, rep_levels, row_data.double_values.data() + value_offset);
+        return double_writer->estimated_buffered_value_bytes();
+    }
+    case parquet::Type::BYTE_ARRAY:
+    {
+        parquet::ByteArrayWriter *byte_array_writer = static_cast<parquet::ByteArrayWriter *>(column_writer);
+        byte_array_writer->WriteBatch(length, def_levels, rep_levels, row_data.byte_array_values.data() + value_offset);
+        return byte_array_writer->estimated_buffered_value_bytes();
+    }
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+    {
+        parquet::FixedLenByteArrayWriter *fixed_len_byte_array_writer = static_cast<parquet::FixedLenByteArrayWriter *>(column_writer);
+        fixed_len_byte_array_writer->WriteBatch(length, def_levels, rep_levels, row_data.fixed_len_byte_array.data() + value_offset);
+        return fixed_len_byte_array_writer->estimated_buffered_value_bytes();
+    }
+    default:
+        return 0;
+    }
+}
 
-        (*global_current_keys).push_back(str);
-        string col = boost::algorithm::join((*global_current_keys), ".");
-        if ((*global_defined_keys).find(col) == (*global_defined_keys).end())
-        {
-            global_new_key = true;
-        }
-        (*global_defined_keys).emplace(col);
-        int index = -1;
-        if (global_leaf_indices->find(col) != global_leaf_indices->end())
-        {
-            index = (*global_leaf_indices)[col];
-        }
-        // only add leaf keys
-        if (index >= 0)
-        {
-            // only add key if not already found
-            if (std::find((*global_found_keys).begin(), (*global_found_keys).end(), index) == (*global_found_keys).end())
-            {
-                (*global_found_keys).push_back(index);
-            }
-        }
-        auto col_field = getFieldFromPath(global_current_keys);
-        if (col_field->path()->ToDotString() != col)
-        {
-            // fail parser if field not found
-            return false;
-        }
-        if (col_field->is_required())
+// end the row that is partly written with a null in every column that has no level of it yet
+// required columns without optional parent get a zero value, so all columns have the same number of rows
+// and the row group can be closed, the levels of the row do not need to match between the columns
+void completeOpenRow(conversion_context *ctx)
+{
+    const int16_t level = 0;
+    for (int col = 0; col < ctx->file_writer->num_columns(); col++)
+    {
+        if (ctx->column_row_open[col])
         {
-            global_required_count++;
+            ctx->column_row_open[col] = false;
+            continue;
         }
+        parquet::ColumnWriter *column_writer = ctx->rg_writer->column(col);
+        column filler;
+        filler.bool_values.push_back(false);
+        filler.int32_values.push_back(0);
+        filler.int64_values.push_back(0);
+        filler.double_values.push_back(0);
+        filler.byte_array_values.push_back(parquet::ByteArray());
+        vector<uint8_t> zeros(std::max(0, column_writer->descr()->type_length()), 0);
+        filler.fixed_len_byte_array.push_back(parquet::FixedLenByteArray(zeros.data()));
+        ctx->buffered_values_estimate[col] = writeColumn(column_writer, filler, &level, &level, 1, 0);
+    }
+    ctx->row_count++;
+    ctx->total_row_count++;
+}
+
+// run task(col) for every column, on the worker pool of the conversion if it has one
+template <typename Task>
+void runColumns(conversion_context *ctx, int num_columns, Task task)
+{
+    if (ctx->pool != nullptr)
+    {
+        ctx->pool->run(num_columns, task);
+        return;
+    }
+    for (int col = 0; col < num_columns; col++)
+    {
+        task(col);
+    }
+}
 
+// close the current row group and append a new one when the current one is full
+// a row that is partly written has to end in the current row group
+void startRowGroupIfFull(conversion_context *ctx)
+{
+    if (ctx->writer_row_open)
+    {
+        return;
+    }
+    uint64_t estimated_bytes = 0;
+    // Get the estimated size of the values that are not written to a page yet
+    for (uint64_t estimate : ctx->buffered_values_estimate)
+    {
+        estimated_bytes += estimate;
+    }
+
+    // We need to consider the compressed pages
+    // as well as the values that are not compressed yet
+    uint64_t total_bytes_written = ctx->rg_writer->total_bytes_written();
+    uint64_t total_compressed_bytes = ctx->rg_writer->total_compressed_bytes();
+    // over the memory budget the row group is closed early to release its pages
+    // unless it holds less than the batch that is written now, that would only give tiny row groups
+    if (((total_bytes_written + total_compressed_bytes + estimated_bytes) > ctx->settings->row_group_size) || ctx->row_count >= ctx->settings->num_rows_per_row_group ||
+        (ctx->row_count > 0 && memoryExceeded(ctx->settings) && ctx->charged_row_group_bytes >= ctx->charged_batch_bytes))
+    {
+        ctx->rg_writer->Close();
+        std::fill(ctx->buffered_values_estimate.begin(), ctx->buffered_values_estimate.end(), 0);
+        ctx->rg_writer = ctx->file_writer->AppendBufferedRowGroup();
+        ctx->row_count = 0;
+        chargeMemory(ctx->settings, &ctx->charged_row_group_bytes, 0);
+    }
+}
+
+// write all buffered rows of the current batch to the current row group
+// a new row group is started when the current one is full, within a batch only at a row boundary
+// with row_continues the levels of the unfinished row at the end are written too, the row ends in a later batch
+bool flushBatch(conversion_context *ctx, bool partial_row = false, bool row_continues = false)
+{
+    if (ctx->batch_rows == 0 && !row_continues && !ctx->writer_row_open)
+    {
         return true;
     }
 
-    bool checkChildren(parquet::schema::NodePtr node, bool req_parent = false)
+    try
     {
-        string parent_path = node->parent()->path()->ToDotString();
-        (*global_defined_keys).emplace(node->path()->ToDotString());
-        // still on path and not leaf
-        if (node->is_group())
+        uint64_t estimated_bytes = 0;
+        uint64_t total_bytes_written = 0;
+        uint64_t total_compressed_bytes = 0;
+        int num_columns = ctx->file_writer->num_columns();
+        // next level and value of each column that is not written yet
+        vector<size_t> level_offsets(num_columns, 0);
+        vector<size_t> value_offsets(num_columns, 0);
+        uint64_t rows_left = ctx->batch_rows;
+        while (rows_left > 0)
         {
-            // parent is required, so all required children need to be defined
-            // parent required AND required AND undefined
-            if (req_parent &&
-                node->is_required() &&
-                ((global_def_keys_per_object->find(parent_path) == global_def_keys_per_object->end()) ||
-                 (*global_def_keys_per_object)[parent_path].find(node->name()) == (*global_def_keys_per_object)[parent_path].end()))
-            {
-                return false;
-            }
-            bool no_error = true;
-            bool req_fields_defined = true;
-            std::shared_ptr<GroupNode> step_group_field = std::static_pointer_cast<GroupNode>(node);
-            for (int i = 0; i < step_group_field->field_count(); i++)
+            startRowGroupIfFull(ctx);
+
+            // a batch that does not fit into the row group any more is split at a row boundary
+            uint64_t rows = std::min(rows_left, std::max<uint64_t>(1, ctx->settings->num_rows_per_row_group - ctx->row_count));
+            bool split = rows < rows_left;
+            bool limit_levels = split || partial_row || row_continues;
+
+            // for column in parquet schema: generate column_writer
+            // the columns are independent, with column_threads they are encoded and compressed concurrently
+            runColumns(ctx, num_columns, [&](int col)
+                        {
+                column &row_data = ctx->parquet_data[col];
+                size_t level_begin = level_offsets[col];
+                // def and rep level should be the same
+                size_t level_end = row_data.definition_levels.size();
+                if (limit_levels)
+                {
+                    // leave out the levels of the following rows and of the row that was not finished
+                    // a row that was partly written before has no repetition level 0 in this batch
+                    level_end = completeRowLevels(row_data, level_begin, ctx->column_row_open[col] ? rows - 1 : rows);
+                }
+                int data_length = level_end - level_begin;
+                const int16_t *def_levels = row_data.definition_levels.data() + level_begin;
+                const int16_t *rep_levels = row_data.repetition_levels.data() + level_begin;
+                size_t value_offset = value_offsets[col];
+
+                // get type from file/rg writer and switch column_writer accordingly
+                auto column = ctx->rg_writer->column(col);
+                ctx->buffered_values_estimate[col] = writeColumn(column, row_data, def_levels, rep_levels, data_length, value_offset);
+                // the first row of the column that was partly written before ends with this pass
+                ctx->column_row_open[col] = false;
+
+                if (split || row_continues)
+                {
+                    // only levels with the maximum definition level carry a value
+                    value_offsets[col] += std::count(def_levels, def_levels + data_length, column->descr()->max_definition_level());
+                    level_offsets[col] = level_end;
+                } });
+            ctx->writer_row_open = false;
+            ctx->row_count += rows;
+            ctx->total_row_count += rows;
+            rows_left -= rows;
+            if (ctx->settings->memory != nullptr)
             {
-                no_error = no_error && checkChildren(step_group_field->field(i), node->is_required());
-                // for each node on path check required
-                // if required, then fail parser if any required child is missing
-                if (step_group_field->field(i)->is_required())
+                // the row group keeps its encoded pages and the values of the unfinished pages in memory until it is closed
+                uint64_t row_group_bytes = ctx->rg_writer->total_bytes_written() + ctx->rg_writer->total_compressed_bytes();
+                for (int n = 0; n < num_columns; n++)
                 {
-                    req_fields_defined = req_fields_defined &&
-                                         ((global_def_keys_per_object->find(parent_path) != global_def_keys_per_object->end()) &&
-                                          (*global_def_keys_per_object)[parent_path].find(step_group_field->field(i)->name()) != (*global_def_keys_per_object)[parent_path].end());
+                    row_group_bytes += ctx->buffered_values_estimate[n];
                 }
+                chargeMemory(ctx->settings, &ctx->charged_row_group_bytes, row_group_bytes);
             }
-            global_def_keys_per_object->erase(step_group_field->path()->ToDotString());
-            if (req_parent && !req_fields_defined)
+
+            if (ctx->settings->logs)
             {
-                return false;
+                estimated_bytes = 0;
+                // Get the estimated size of the values that are not written to a page yet
+                for (int n = 0; n < num_columns; n++)
+                {
+                    estimated_bytes += ctx->buffered_values_estimate[n];
+                }
+
+                // We need to consider the compressed pages
+                // as well as the values that are not compressed yet
+                total_bytes_written = ctx->rg_writer->total_bytes_written();
+                total_compressed_bytes = ctx->rg_writer->total_compressed_bytes();
+                if (((total_bytes_written + total_compressed_bytes + estimated_bytes) > ctx->settings->row_group_size) || ctx->row_count >= ctx->settings->num_rows_per_row_group)
+                {
+                    auto now = std::chrono::system_clock::now();
+                    ostringstream oss;
+                    oss << now << ": FINISH row group, rows in row group: " << ctx->row_count << ", total rows written: " << ctx->total_row_count << "\n";
+                    printLog(oss.str());
+                }
             }
-            return no_error;
         }
 
-        // reached leaf -> get full path
-        string leaf_path = node->path()->ToDotString();
-        int leaf_index = -1;
-        if (global_leaf_indices->find(leaf_path) != global_leaf_indices->end())
+        if (row_continues)
         {
-            leaf_index = (*global_leaf_indices)[leaf_path];
+            // the levels of the unfinished row go to the current row group, the row continues in the next batch
+            startRowGroupIfFull(ctx);
+            runColumns(ctx, num_columns, [&](int col)
+                        {
+                column &row_data = ctx->parquet_data[col];
+                size_t level_begin = level_offsets[col];
+                int data_length = row_data.definition_levels.size() - level_begin;
+                auto column = ctx->rg_writer->column(col);
+                ctx->buffered_values_estimate[col] = writeColumn(column, row_data, row_data.definition_levels.data() + level_begin,
+                                                                 row_data.repetition_levels.data() + level_begin, data_length, value_offsets[col]);
+                ctx->column_row_open[col] = ctx->column_row_open[col] || data_length > 0; });
+            ctx->writer_row_open = true;
         }
-        if (leaf_index < 0)
+        else if (partial_row && ctx->writer_row_open)
         {
-            // leaf not found in schema -> something is wrong
-            return false;
+            // the row that failed to parse was partly written already, its remaining levels are left out
+            completeOpenRow(ctx);
+            ctx->writer_row_open = false;
+            ctx->broken_row_written = true;
         }
 
-        if (std::find((*global_found_keys).begin(), (*global_found_keys).end(), leaf_index) == (*global_found_keys).end())
+        for (int col = 0; col < num_columns; col++)
         {
-            // not found in keys of this row
-            // should only be checked if all parents are also required
-            if (allFieldsInPathRequired(&(node->path()->ToDotVector())))
+            ctx->parquet_data[col].definition_levels.clear();
+            ctx->parquet_data[col].repetition_levels.clear();
+            ctx->parquet_data[col].bool_values.clear();
+            ctx->parquet_data[col].int32_values.clear();
+            ctx->parquet_data[col].int64_values.clear();
+            ctx->parquet_data[col].double_values.clear();
+            ctx->parquet_data[col].byte_array_values.clear();
+            ctx->parquet_data[col].fixed_len_byte_array.clear();
+            ctx->parquet_data[col].string_values.clear();
+        }
+        ctx->batch_rows = 0;
+        ctx->batch_bytes = 0;
+        if (ctx->settings->memory != nullptr)
+        {
+            // the cleared buffers keep their capacity for the next batch, it stays charged
+            chargeMemory(ctx->settings, &ctx->charged_batch_bytes, batchMemory(ctx->parquet_data));
+            if (memoryExceeded(ctx->settings))
             {
-                // leaf not found but is required
-                return false;
+                // the budget is used up, the buffers are given back
+                for (int col = 0; col < num_columns; col++)
+                {
+                    ctx->parquet_data[col] = column();
+                }
+                chargeMemory(ctx->settings, &ctx->charged_batch_bytes, 0);
             }
-            (*global_found_keys).push_back(leaf_index);
         }
+    }
+    catch (const std::exception &e)
+    {
+        auto now = std::chrono::system_clock::now();
+        ostringstream oss;
+        oss << now << ": Writing error: " << e.what() << "\n";
+        printLog(oss.str());
+        return false;
+    }
+    return true;
+}
 
-        // get correct node_name, if element take current_keys
-        string node_name = node->name();
-        if (node_name == "element")
-        {
-            node_name = node->path()->ToDotVector().at((*global_current_keys).size());
-            parent_path = boost::algorithm::join((*global_current_keys), ".");
-        }
+// wait while the memory budget is used up and bytes handed on to a writer are still being written, they release memory
+// does not wait when nothing else can release memory, the caller writes its batch early then
+void waitForMemory(conversion_context *ctx)
+{
+    memory_budget *memory = ctx->settings->memory;
+    batch_queue *queue = ctx->queue;
+    if (memory == nullptr)
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(memory->mutex);
+    memory->released.wait(lock, [&]()
+                          { return memory->used <= memory->limit || memory->handed_on == 0 ||
+                                   (queue != nullptr && (queue->awaited || queue->failed)); });
+}
 
-        // new key in this object
-        if ((global_def_keys_per_object->find(parent_path) == global_def_keys_per_object->end()) || ((*global_def_keys_per_object)[parent_path].find(node_name) == (*global_def_keys_per_object)[parent_path].end()))
+// the batch holds at least its thread's share of the memory budget
+// writing a smaller batch early would hardly release anything and only give tiny batches
+bool batchOverShare(const conversion_context *ctx)
+{
+    return ctx->charged_batch_bytes >= ctx->settings->memory->limit / std::max(1, ctx->settings->threads);
+}
+
+// hand a batch to the encoder, waits while the queue is full
+bool pushBatch(batch_queue *queue, pending_batch batch)
+{
+    {
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        queue->changed.wait(lock, [&]()
+                            { return queue->failed || queue->full.size() < queue->capacity; });
+        if (queue->failed)
         {
-            global_new_key = true;
-            (*global_def_keys_per_object)[parent_path].emplace(node_name);
+            return false;
         }
+        queue->full.push_back(std::move(batch));
+    }
+    queue->changed.notify_all();
+    return true;
+}
 
-        (*global_parquet_data)[leaf_index].definition_levels.push_back((*global_current_keys).size() - global_required_count);
-        (*global_parquet_data)[leaf_index].repetition_levels.push_back(rep_level());
-        global_new_key = false;
-        global_new_array = false;
+// a batch handed on to a writer is left out after an error, its bytes are released
+void dropBatch(const conversion_settings *settings, pending_batch *batch)
+{
+    if (settings->memory != nullptr)
+    {
+        settings->memory->arrived(batch->charged_bytes);
+    }
+    chargeMemory(settings, &batch->charged_bytes, 0);
+}
 
-        return true;
+// the free batches of a queue are not reused any more, the capacity they retain is released
+void releaseFreeBatches(const conversion_settings *settings, batch_queue *queue)
+{
+    for (pending_batch &batch : queue->free)
+    {
+        chargeMemory(settings, &batch.charged_bytes, 0);
     }
-    bool EndObject(SizeType memberCount)
+    queue->free.clear();
+}
+
+// encode the batches of the queue into the file writer of the context until the queue is closed, runs on its own thread
+void encodeBatches(conversion_context *ctx, batch_queue *queue)
+{
+    while (true)
     {
-        // end of object, so remove key from stack (last key within object, only while nested)
-        if (memberCount > 0)
+        pending_batch batch;
         {
-            string prev_path = boost::algorithm::join((*global_current_keys), ".");
-            auto prev_field = getFieldFromPath(global_current_keys);
-            if (prev_field->path()->ToDotString() != prev_path)
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->changed.wait(lock, [&]()
+                                { return queue->closed || !queue->full.empty(); });
+            if (queue->full.empty())
             {
-                // fail parser if field not found
-                return false;
-            }
-
-            if (prev_field->is_required())
-            {
-                global_required_count--;
+                return;
             }
-            (*global_current_keys).pop_back();
+            batch = std::move(queue->full.front());
+            queue->full.pop_front();
         }
-
-        global_new_object = false;
-        global_new_array = false;
-
-        string current_path = boost::algorithm::join((*global_current_keys), ".");
-
-        parquet::schema::NodePtr current_field = (*global_parquet_schema);
-        if ((*global_current_keys).size() > 0)
+        queue->changed.notify_all();
+
+        std::swap(ctx->parquet_data, batch.columns);
+        ctx->batch_rows = batch.rows;
+        uint64_t handed_on = batch.charged_bytes;
+        std::swap(ctx->charged_batch_bytes, batch.charged_bytes);
+        bool written = flushBatch(ctx, batch.partial_row, batch.row_continues);
+        std::swap(ctx->parquet_data, batch.columns);
+        // the retained capacity stays charged to the columns going back to the shredder
+        std::swap(ctx->charged_batch_bytes, batch.charged_bytes);
+        if (!written)
         {
-            current_field = getFieldFromPath(global_current_keys);
+            // the rows of the failed batch are not left for the last flushBatch
+            ctx->batch_rows = 0;
         }
-        if (current_field->path()->ToDotString() != current_path)
         {
-            return false;
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->free.push_back(std::move(batch));
+            queue->failed = !written;
         }
-
-        if (!(current_field->is_group()))
+        queue->changed.notify_all();
+        if (ctx->settings->memory != nullptr)
         {
-            // should be group, otherwise no object
-            // something is wrong, fail parser
-            return false;
+            // also wakes a shredder waiting for memory after a failure, it stops then
+            ctx->settings->memory->arrived(handed_on);
         }
-
-        bool root_result = true;
-
-        std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(current_field);
-        // check if fields are missing, otherwise done with object
-        if (memberCount != group_field->field_count())
+        if (!written)
         {
-            // get all root keys
-            // -> checkChildren for all missing ones
-            for (int i = 0; i < group_field->field_count(); i++)
-            {
-                auto field = group_field->field(i);
-                // key is not already defined in object
-                if ((global_def_keys_per_object_individual->find(current_path) == global_def_keys_per_object_individual->end()) || ((*global_def_keys_per_object_individual)[current_path].find(field->name()) == (*global_def_keys_per_object_individual)[current_path].end()))
-                {
-                    // if parent is list, ignore def_keys_per_object
-                    if ((*global_current_keys).size() > 0 && (string)group_field->parent()->name() == "list")
-                    {
-                        root_result = root_result && checkChildren(field);
-                    }
-                    else if ((global_def_keys_per_object->find(current_path) == global_def_keys_per_object->end()) || ((*global_def_keys_per_object)[current_path].find(field->name()) == (*global_def_keys_per_object)[current_path].end()))
-                    {
-                        // iterate over children (DFS, children of children)
-                        root_result = root_result && checkChildren(field);
-                    }
-                }
-            }
+            return;
         }
+    }
+}
 
-        // json should be array of rows -> each row is one object
-        // if EndObject is also end of row:
-        if ((*global_current_keys).size() == 0) // only 0 at end of row
+// the current batch is full: write it, or keep it for the writer when shredding a chunk or encoding on another thread
+bool finishBatch(conversion_context *ctx, bool partial_row = false, bool row_continues = false)
+{
+    if (ctx->queue == nullptr)
+    {
+        ctx->write_failed = !flushBatch(ctx, partial_row, row_continues);
+        return !ctx->write_failed;
+    }
+    if (ctx->batch_rows == 0 && !row_continues)
+    {
+        return true;
+    }
+    // the charged bytes move with the batch to the writer
+    pending_batch batch{std::move(ctx->parquet_data), ctx->batch_rows, partial_row, row_continues, ctx->charged_batch_bytes};
+    ctx->parquet_data.clear();
+    uint64_t charged = ctx->charged_batch_bytes;
+    ctx->charged_batch_bytes = 0;
+    if (ctx->settings->memory != nullptr)
+    {
+        ctx->settings->memory->handOn(charged);
+    }
+    if (!pushBatch(ctx->queue, std::move(batch)))
+    {
+        // the writer stopped, the batch is left out
+        if (ctx->settings->memory != nullptr)
+        {
+            ctx->settings->memory->arrived(charged);
+        }
+        chargeMemory(ctx->settings, &charged, 0);
+        ctx->write_failed = true;
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(ctx->queue->mutex);
+        if (!ctx->queue->free.empty())
         {
-            (*global_found_keys).clear();
-            (*global_defined_keys).clear();
+            ctx->parquet_data = std::move(ctx->queue->free.back().columns);
+            ctx->charged_batch_bytes = ctx->queue->free.back().charged_bytes;
+            ctx->queue->free.pop_back();
+        }
+    }
+    if (ctx->parquet_data.empty())
+    {
+        ctx->parquet_data = vector<column>(ctx->settings->num_columns);
+    }
+    ctx->batch_rows = 0;
+    ctx->batch_bytes = 0;
+    return true;
+}
 
-            // write whole row to current row_group
-            try
+// end of the JSON value starting at p, only quotes and brackets are matched, nothing is decoded
+// nullptr if the value does not end before end
+const char *skipJSONValue(const char *p, const char *end)
+{
+    if (p == end || *p == ',' || *p == '}' || *p == ']')
+    {
+        return nullptr;
+    }
+    if (*p != '"' && *p != '{' && *p != '[')
+    {
+        // number, true, false or null
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+        {
+            p++;
+        }
+        return p;
+    }
+    int depth = 0;
+    while (p < end)
+    {
+        char c = *p++;
+        if (c == '"')
+        {
+            // the string ends at the first quote behind an even number of backslashes
+            while (true)
             {
-                uint64_t estimated_bytes = 0;
-                int num_columns = (*global_file_writer)->num_columns();
-                // Get the estimated size of the values that are not written to a page yet
-                for (int n = 0; n < num_columns; n++)
-                {
-                    estimated_bytes += (*global_buffered_values_estimate)[n];
-                }
-
-                // We need to consider the compressed pages
-                // as well as the values that are not compressed yet
-                uint64_t total_bytes_written = global_rg_writer->total_bytes_written();
-                uint64_t total_compressed_bytes = global_rg_writer->total_compressed_bytes();
-                if (((total_bytes_written + total_compressed_bytes + estimated_bytes) > global_row_group_size) || global_row_count >= global_num_rows_per_row_group)
-                {
-                    global_rg_writer->Close();
-                    std::fill(global_buffered_values_estimate->begin(), global_buffered_values_estimate->end(), 0);
-                    global_rg_writer = (*global_file_writer)->AppendBufferedRowGroup();
-                    global_row_count = 0;
-                }
-
-                // for column in parquet schema: generate column_writer
-                for (int col = 0; col < num_columns; col++)
+                const char *quote = static_cast<const char *>(memchr(p, '"', end - p));
+                if (quote == nullptr)
                 {
-
-                    column row_data = (*global_parquet_data)[col];
-                    // def and rep level should be the same
-                    int data_length = row_data.definition_levels.size();
-
-                    // get type from file/rg writer and switch column_writer accordingly
-                    auto column = global_rg_writer->column(col);
-                    auto column_type = column->type();
-                    auto col_log_type = column->descr()->logical_type();
-
-                    if (column_type == parquet::Type::BOOLEAN)
-                    {
-                        parquet::BoolWriter *bool_writer = static_cast<parquet::BoolWriter *>(column);
-                        bool tmp_values[row_data.bool_values.size()];
-                        for (int i = 0; i < row_data.bool_values.size(); i++)
-                        {
-                            tmp_values[i] = row_data.bool_values[i];
-                        }
-                        bool_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &tmp_values[0]);
-                        (*global_buffered_values_estimate)[col] = bool_writer->estimated_buffered_value_bytes();
-                    }
-                    else if (column_type == parquet::Type::INT32)
-                    {
-                        parquet::Int32Writer *int32_writer = static_cast<parquet::Int32Writer *>(column);
-                        int32_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &row_data.int32_values[0]);
-                        (*global_buffered_values_estimate)[col] = int32_writer->estimated_buffered_value_bytes();
-                    }
-                    else if (column_type == parquet::Type::INT64)
-                    {
-                        parquet::Int64Writer *int64_writer = static_cast<parquet::Int64Writer *>(column);
-                        int64_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &row_data.int64_values[0]);
-                        (*global_buffered_values_estimate)[col] = int64_writer->estimated_buffered_value_bytes();
-                    }
-                    else if (column_type == parquet::Type::DOUBLE)
-                    {
-                        parquet::DoubleWriter *double_writer = static_cast<parquet::DoubleWriter *>(column);
-                        double_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &row_data.double_values[0]);
-                        (*global_buffered_values_estimate)[col] = double_writer->estimated_buffered_value_bytes();
-                    }
-                    else if (column_type == parquet::Type::BYTE_ARRAY)
-                    {
-                        parquet::ByteArrayWriter *byte_array_writer = static_cast<parquet::ByteArrayWriter *>(column);
-                        if (col_log_type->is_string())
-                        {
-                            vector<parquet::ByteArray> tmp_values;
-                            for (int i = 0; i < row_data.string_values.size(); i++)
-                            {
-                                tmp_values.push_back(parquet::ByteArray(row_data.string_values[i]));
-                            }
-                            byte_array_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &tmp_values[0]);
-                        }
-                        else
-                        {
-                            byte_array_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &row_data.byte_array_values[0]);
-                        }
-                        (*global_buffered_values_estimate)[col] = byte_array_writer->estimated_buffered_value_bytes();
-                    }
-                    else if (column_type == parquet::Type::FIXED_LEN_BYTE_ARRAY)
-                    {
-                        parquet::FixedLenByteArrayWriter *fixed_len_byte_array_writer = static_cast<parquet::FixedLenByteArrayWriter *>(column);
-                        fixed_len_byte_array_writer->WriteBatch(data_length, &row_data.definition_levels[0], &row_data.repetition_levels[0], &row_data.fixed_len_byte_array[0]);
-                        (*global_buffered_values_estimate)[col] = fixed_len_byte_array_writer->estimated_buffered_value_bytes();
-                    }
-
-                    (*global_parquet_data)[col].definition_levels.clear();
-                    (*global_parquet_data)[col].repetition_levels.clear();
-                    (*global_parquet_data)[col].bool_values.clear();
-                    (*global_parquet_data)[col].int32_values.clear();
-                    (*global_parquet_data)[col].int64_values.clear();
-                    (*global_parquet_data)[col].double_values.clear();
-                    (*global_parquet_data)[col].byte_array_values.clear();
-                    (*global_parquet_data)[col].fixed_len_byte_array.clear();
-                    (*global_parquet_data)[col].string_values.clear();
+                    return nullptr;
                 }
-                global_row_count++;
-                global_total_row_count++;
-
-                if (global_logs)
+                const char *escapes = quote;
+                while (escapes > p && escapes[-1] == '\\')
                 {
-                    estimated_bytes = 0;
-                    // Get the estimated size of the values that are not written to a page yet
-                    for (int n = 0; n < num_columns; n++)
-                    {
-                        estimated_bytes += (*global_buffered_values_estimate)[n];
-                    }
-
-                    // We need to consider the compressed pages
-                    // as well as the values that are not compressed yet
-                    total_bytes_written = global_rg_writer->total_bytes_written();
-                    total_compressed_bytes = global_rg_writer->total_compressed_bytes();
-                    if (((total_bytes_written + total_compressed_bytes + estimated_bytes) > global_row_group_size) || global_row_count >= global_num_rows_per_row_group)
-                    {
-                        auto now = std::chrono::system_clock::now();
-                        ostringstream oss;
-                        oss << now << ": FINISH row group, rows in row group: " << global_row_count << ", total rows written: " << global_total_row_count << "\n";
-                        string log = oss.str();
-                        fmt::print(log);
-                        if (logfile->is_open())
-                        {
-                            (*logfile) << log;
-                        }
-                    }
+                    escapes--;
                 }
-            }
-            catch (const std::exception &e)
-            {
-                auto now = std::chrono::system_clock::now();
-                ostringstream oss;
-                oss << now << ": Writing error: " << e.what() << "\n";
-                string log = oss.str();
-                fmt::print(log);
-                if (logfile->is_open())
+                p = quote + 1;
+                if ((quote - escapes) % 2 == 0)
                 {
-                    (*logfile) << log;
+                    break;
                 }
-                return false;
             }
         }
+        else if (c == '{' || c == '[')
+        {
+            depth++;
+        }
+        else if (c == '}' || c == ']')
+        {
+            depth--;
+        }
+        if (depth == 0)
+        {
+            return p;
+        }
+    }
+    return nullptr;
+}
 
-        // need to keep entry within array but delete at end of array
-        // only delete if current_path is not repeated
-        if ((*global_current_keys).size() == 0 || (string)group_field->parent()->name() != "list")
+// memory stream like rapidjson::MemoryStream, the handler can move it past the value of a key whose columns are not selected
+// the value is replaced by null, the input continues behind it once the null is read
+struct skipping_stream
+{
+    typedef char Ch;
+
+    skipping_stream(const Ch *src, size_t size) : src_(src), begin_(src), end_(src + size), input_end_(src + size) {}
+
+    Ch Peek() const
+    {
+        if (RAPIDJSON_UNLIKELY(src_ == end_))
         {
-            global_def_keys_per_object->erase(current_path);
+            return resume_ != nullptr && resume_ != input_end_ ? *resume_ : '\0';
         }
-        global_def_keys_per_object_individual->erase(current_path);
-        return root_result;
+        return *src_;
     }
-    bool StartArray()
+    Ch Take()
     {
-        // check if current field is repeated
-        if ((*global_current_keys).size() > 0)
+        if (RAPIDJSON_UNLIKELY(src_ == end_))
         {
-            (*global_current_keys).push_back("list");
-            auto field = getFieldFromPath(global_current_keys);
-            // fail if field is not repeated
-            if (!field->is_repeated())
+            if (resume_ == nullptr)
             {
-                return false;
+                return '\0';
             }
-            string list_col = boost::algorithm::join((*global_current_keys), ".");
-            (*global_current_keys).push_back("element");
-            string col = boost::algorithm::join((*global_current_keys), ".");
-            // neither list nor element in defined
-            if ((*global_defined_keys).find(list_col) == (*global_defined_keys).end() && ((*global_defined_keys).find(col) == (*global_defined_keys).end()))
+            src_ = resume_;
+            end_ = input_end_;
+            resume_ = nullptr;
+            if (src_ == end_)
             {
-                global_new_key = true;
+                return '\0';
             }
-            // add [...].list to defined but not element
-            (*global_defined_keys).emplace(list_col);
+        }
+        return *src_++;
+    }
+    size_t Tell() const { return static_cast<size_t>((resume_ != nullptr ? resume_ : src_) - begin_); }
+
+    Ch *PutBegin()
+    {
+        RAPIDJSON_ASSERT(false);
+        return 0;
+    }
+    void Put(Ch) { RAPIDJSON_ASSERT(false); }
+    void Flush() { RAPIDJSON_ASSERT(false); }
+    size_t PutEnd(Ch *)
+    {
+        RAPIDJSON_ASSERT(false);
+        return 0;
+    }
 
-            if (!global_new_array)
+    // called right behind a key, false if its value does not end in the input, then it is parsed as usual
+    bool skipValue()
+    {
+        static const Ch skipped_value[] = ":null";
+        const Ch *p = src_;
+        while (p < end_ && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        {
+            p++;
+        }
+        if (p == end_ || *p != ':')
+        {
+            return false;
+        }
+        p++;
+        while (p < end_ && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        {
+            p++;
+        }
+        const Ch *value_end = skipJSONValue(p, end_);
+        if (value_end == nullptr)
+        {
+            return false;
+        }
+        resume_ = value_end;
+        src_ = skipped_value;
+        end_ = skipped_value + sizeof(skipped_value) - 1;
+        return true;
+    }
+    // called behind a value inside `objects` open objects, the rest of them is replaced by their closing braces
+    // false if they do not end in the input, then the rest is parsed as usual
+    bool skipObjects(int objects)
+    {
+        static const Ch closing_braces[] = "}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}";
+        if (resume_ != nullptr || objects >= static_cast<int>(sizeof(closing_braces)))
+        {
+            return false;
+        }
+        // the scan starts inside the innermost object, in front of a comma or its closing brace
+        const Ch *p = src_;
+        int depth = objects;
+        while (p < end_)
+        {
+            const Ch *value_end = *p == '"' || *p == '{' || *p == '[' ? skipJSONValue(p, end_) : p + 1;
+            if (value_end == nullptr)
             {
-                global_new_array_depth = global_repeated_count;
+                return false;
             }
-            global_repeated_count++;
-            global_new_array = true;
-            int index = -1;
-            if (global_leaf_indices->find(col) != global_leaf_indices->end())
+            if (*p == '}' || *p == ']')
             {
-                index = (*global_leaf_indices)[col];
+                depth--;
             }
-            // only add leaf keys
-            if (index >= 0)
+            p = value_end;
+            if (depth == 0)
             {
-                // only add key if not already found
-                if (std::find((*global_found_keys).begin(), (*global_found_keys).end(), index) == (*global_found_keys).end())
-                {
-                    (*global_found_keys).push_back(index);
-                }
+                resume_ = p;
+                src_ = closing_braces;
+                end_ = closing_braces + objects;
+                return true;
             }
         }
+        return false;
+    }
+
+    const Ch *src_;
+    const Ch *begin_;
+    const Ch *end_;
+    const Ch *input_end_;
+    // where the input continues behind a skipped value while the null is read
+    const Ch *resume_ = nullptr;
+};
+
+struct MyHandler : public BaseReaderHandler<UTF8<>, MyHandler>
+{
+    conversion_context *ctx;
+    const vector<schema_node> &nodes;
+    // the JSON schema is checked here instead of by the generic validator
+    const bool validate;
+    bool in_root_array = false;
+    // keyword of the JSON schema the rejected value violates, and the node it belongs to
+    const char *invalid_keyword = nullptr;
+    int invalid_node = 0;
+    // inside the value of a key whose columns are not selected, with the arrays and objects open in it
+    bool skipping = false;
+    int skip_depth = 0;
+    // set while the handler parses an in-memory stream directly, skipped values are not parsed at all then
+    skipping_stream *skip_stream = nullptr;
+    // the --where expression and the results of its comparisons in the current row
+    const vector<where_node> &where_nodes;
+    const int where_root;
+    vector<truth> where_results;
+    // the expression is already true for the row, or it can not be any more and the rest of the row is skipped
+    bool row_matched = false;
+    bool row_rejected = false;
+    // state before the key of an object or array, restored if its value is null
+    bool key_defined_child = false;
+    bool key_defined_node = false;
+    bool key_new_key = false;
+
+    MyHandler(conversion_context *context)
+        : ctx(context), nodes(context->settings->schema_nodes), validate(context->settings->inline_validation),
+          where_nodes(context->settings->where_nodes), where_root(context->settings->where_root), where_results(where_nodes.size(), truth::pending) {}
+
+    bool invalid(const char *keyword)
+    {
+        invalid_keyword = keyword;
+        invalid_node = ctx->current_node;
+        return false;
+    }
+    // the key belongs to columns that are not selected with --columns, its value is left out
+    // false for keys that are not in the schema at all
+    bool skipKey(const char *str, SizeType length)
+    {
+        const vector<string> &skipped = nodes[ctx->current_node].skipped_children;
+        if (!std::binary_search(skipped.begin(), skipped.end(), string_view(str, length)))
+        {
+            return false;
+        }
+        // the next key does not leave this one
+        ctx->new_object = true;
+        skipping = true;
+        skip_depth = 0;
+        if (skip_stream != nullptr)
+        {
+            skip_stream->skipValue();
+        }
         return true;
     }
-    bool EndArray(SizeType elementCount)
+    // an event inside a skipped value, the value is done when no array or object is open in it any more
+    bool skipEvent(int depth_change)
     {
-        bool root_result = true;
-        if ((*global_current_keys).size() > 0)
+        skip_depth += depth_change;
+        skipping = skip_depth > 0;
+        return true;
+    }
+    // take the levels and values of the current row out of the batch and start the next row from the root
+    void rollbackRow()
+    {
+        for (size_t i = 0; i < ctx->row_begin_levels.size(); i++)
         {
-            if (elementCount > 0)
-            {
-                // there are actual elements in the array
-                // add [...].element to defined
-                (*global_defined_keys).emplace(boost::algorithm::join((*global_current_keys), "."));
-            }
-            // save column for empty array column index, but remove then for depth
-            string col = boost::algorithm::join((*global_current_keys), ".");
-            // remove "element"
-            (*global_current_keys).pop_back();
-            // remove "list"
-            (*global_current_keys).pop_back();
-            if (elementCount == 0)
+            ctx->parquet_data[i].truncate(ctx->row_begin_levels[i], ctx->row_begin_values[i]);
+        }
+        ctx->batch_bytes = ctx->row_begin_bytes;
+        ctx->current_node = 0;
+        ctx->repeated_count = 0;
+        ctx->new_array_depth = 0;
+        ctx->new_object = false;
+        ctx->new_array = false;
+        ctx->new_key = false;
+        ctx->row_stamp++;
+        std::fill(ctx->defined_nodes.begin(), ctx->defined_nodes.end(), 0);
+        std::fill(ctx->defined_children.begin(), ctx->defined_children.end(), 0);
+        std::fill(ctx->keyed_children.begin(), ctx->keyed_children.end(), 0);
+        skipping = false;
+        skip_depth = 0;
+        startRowFilter();
+    }
+    // take the row that failed out of the batch, the next one starts a new document
+    // false if a batch could not be written
+    bool discardRow()
+    {
+        if (ctx->write_failed)
+        {
+            return false;
+        }
+        rollbackRow();
+        in_root_array = false;
+        invalid_keyword = nullptr;
+        return true;
+    }
+    // the row does not match --where, it was never written in parts
+    void dropRow()
+    {
+        rollbackRow();
+    }
+    // forget the results of the comparisons of the --where expression for the next row
+    void startRowFilter()
+    {
+        std::fill(where_results.begin(), where_results.end(), truth::pending);
+        row_matched = false;
+        row_rejected = false;
+    }
+    // truth value of a node of the --where expression, a comparison that is still pending at the end of the row has no value
+    truth evaluate(int id, bool row_done) const
+    {
+        const where_node &node = where_nodes[id];
+        switch (node.kind)
+        {
+        case where_kind::logical_and:
+        case where_kind::logical_or:
+        {
+            // AND is false with one false child, OR is true with one true child
+            truth decisive = node.kind == where_kind::logical_and ? truth::no : truth::yes;
+            truth result = node.kind == where_kind::logical_and ? truth::yes : truth::no;
+            for (int child : node.children)
             {
-                int column_index = -1;
-                if (global_leaf_indices->find(col) != global_leaf_indices->end())
-                {
-                    column_index = (*global_leaf_indices)[col];
-                }
-                if (column_index >= 0)
+                truth value = evaluate(child, row_done);
+                if (value == decisive)
                 {
-                    (*global_parquet_data)[column_index].definition_levels.push_back(((*global_current_keys).size() - global_required_count));
-                    (*global_parquet_data)[column_index].repetition_levels.push_back(rep_level());
-                    global_new_key = false;
-                    global_new_array = false;
+                    return decisive;
                 }
-                else
+                if (value == truth::pending || (value == truth::unknown && result != truth::pending))
                 {
-                    // array is not leaf -> add def, rep for all leaves
-                    // get current field
-                    parquet::schema::NodePtr current_field = (*global_parquet_schema);
-                    if ((*global_current_keys).size() > 0)
-                    {
-                        for (int i = 0; i < (*global_current_keys).size(); i++)
-                        {
-                            if (current_field->is_group())
-                            {
-                                std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(current_field);
-                                string key = (*global_current_keys).at(i);
-                                int new_index = group_field->FieldIndex(key);
-                                current_field = group_field->field(new_index);
-                            }
-                            else
-                            {
-                                // something went wrong, path should have group nodes
-                                return false;
-                            }
-                        }
-                    }
-                    std::shared_ptr<GroupNode> group_field = std::static_pointer_cast<GroupNode>(current_field);
-                    // check if fields are missing, otherwise done with object
-                    // get all root keys
-                    // -> checkChildren for all missing ones
-                    for (int i = 0; i < group_field->field_count(); i++)
-                    {
-                        auto field = group_field->field(i);
-                        root_result = root_result && checkChildren(field);
-                    }
+                    result = value;
                 }
             }
-            global_repeated_count--;
-            global_def_keys_per_object->erase(col);
-            global_def_keys_per_object_individual->erase(col);
+            return result;
+        }
+        case where_kind::logical_not:
+        {
+            truth value = evaluate(node.children[0], row_done);
+            return value == truth::yes ? truth::no : value == truth::no ? truth::yes : value;
+        }
+        default:
+            if (where_results[id] == truth::pending && row_done)
+            {
+                return node.kind == where_kind::is_null ? truth::yes : node.kind == where_kind::is_not_null ? truth::no : truth::unknown;
+            }
+            return where_results[id];
         }
-        return root_result;
     }
-};
-
-static std::shared_ptr<parquet::schema::Node> createNode(string key, rapidjson::Value::Object *object, bool required)
-{
-    assert(object->HasMember("type"));
-    assert((*object)["type"].IsString());
-    string type = (*object)["type"].GetString();
-    if (type == "array")
+    static int order(const where_literal &literal, int64_t value)
     {
-        assert(object->HasMember("items"));
-        assert((*object)["items"].IsObject());
-        auto items = (*object)["items"].GetObject();
-        auto array_element = createNode("element", &items, false);
-
-        parquet::schema::NodeVector list_element;
-        list_element.push_back(array_element);
-        auto array = GroupNode::Make("list", Repetition::REPEATED, list_element);
-
-        parquet::schema::NodeVector list_elements;
-        list_elements.push_back(array);
-
-        if (required)
+        if (literal.is_integer)
         {
-            return GroupNode::Make(key, Repetition::REQUIRED, list_elements, parquet::LogicalType::List());
+            return value < literal.integer ? -1 : value > literal.integer;
         }
-
-        return GroupNode::Make(key, Repetition::OPTIONAL, list_elements, parquet::LogicalType::List());
+        return order(literal, static_cast<double>(value));
     }
-    else if (type == "object")
+    static int order(const where_literal &literal, double value)
     {
-        parquet::schema::NodeVector column_object;
-
-        vector<string> required_fields;
-        if (object->HasMember("required"))
+        return value < literal.real ? -1 : value > literal.real;
+    }
+    static int order(const where_literal &literal, string_view value)
+    {
+        int compared = value.compare(literal.text);
+        return compared < 0 ? -1 : compared > 0;
+    }
+    // compare the value of a leaf in the --where expression, true if the row can not match any more
+    // the rest of the row is skipped then, and its values are taken out of the batch at its end
+    template <typename T>
+    bool filterValue(const schema_node &node, T value)
+    {
+        if (row_matched)
         {
-            assert((*object)["required"].IsArray());
-            for (auto &req : (*object)["required"].GetArray())
-            {
-                required_fields.push_back((string)req.GetString());
-            }
+            return false;
         }
-
-        assert(object->HasMember("properties"));
-        assert((*object)["properties"].IsObject());
-        for (auto &prop : (*object)["properties"].GetObject())
+        for (int id : node.where_comparisons)
         {
-            string member_key = prop.name.GetString();
-            rapidjson::Value::Object member_value = prop.value.GetObject();
-
-            if (std::find(required_fields.begin(), required_fields.end(), member_key) != required_fields.end())
+            const where_node &comparison = where_nodes[id];
+            if constexpr (std::is_same_v<T, std::nullptr_t>)
             {
-                column_object.push_back(createNode(member_key, &member_value, true));
+                where_results[id] = comparison.kind == where_kind::is_null ? truth::yes : comparison.kind == where_kind::is_not_null ? truth::no : truth::unknown;
+            }
+            else if (comparison.kind == where_kind::is_null || comparison.kind == where_kind::is_not_null)
+            {
+                where_results[id] = comparison.kind == where_kind::is_not_null ? truth::yes : truth::no;
             }
             else
             {
-                column_object.push_back(createNode(member_key, &member_value, false));
+                bool accepted = false;
+                for (const where_literal &literal : comparison.literals)
+                {
+                    int ordering;
+                    if constexpr (std::is_same_v<T, double> || std::is_same_v<T, string_view>)
+                    {
+                        ordering = order(literal, value);
+                    }
+                    else
+                    {
+                        ordering = order(literal, static_cast<int64_t>(value));
+                    }
+                    accepted = accepted || (comparison.accepted & (1 << (ordering + 1)));
+                }
+                where_results[id] = accepted ? truth::yes : truth::no;
             }
         }
-
-        if (required)
+        truth result = evaluate(where_root, false);
+        if (result == truth::pending)
         {
-            return GroupNode::Make(key, Repetition::REQUIRED, column_object);
+            return false;
         }
-        return GroupNode::Make(key, Repetition::OPTIONAL, column_object);
+        if (result == truth::yes)
+        {
+            row_matched = true;
+            return false;
+        }
+        // the objects around a leaf outside of lists are its parents up to the root
+        row_rejected = true;
+        skipping = true;
+        skip_depth = node.depth;
+        if (skip_stream != nullptr)
+        {
+            skip_stream->skipObjects(node.depth);
+        }
+        return true;
     }
-    else if (type == "string")
+    // keyword of the bounds of the JSON schema the number violates, nullptr if it is in range
+    template <typename T>
+    static const char *outOfRange(const schema_node &node, T value)
     {
-        // check format
-        if (object->HasMember("format"))
+        if constexpr (std::is_floating_point_v<T>)
         {
-            assert((*object)["format"].IsString());
-            string format = (*object)["format"].GetString();
-            if (format == "date")
+            if (node.exclusive_minimum ? value <= node.minimum : value < node.minimum)
             {
-                if (required)
-                {
-                    return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Date(), parquet::Type::INT32);
-                }
-                return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Date(), parquet::Type::INT32);
+                return "minimum";
+            }
+            if (node.exclusive_maximum ? value >= node.maximum : value > node.maximum)
+            {
+                return "maximum";
             }
         }
-        if (required)
-        {
-            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::String(), parquet::Type::BYTE_ARRAY);
-        }
-        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::String(), parquet::Type::BYTE_ARRAY);
-    }
-    else if (type == "integer")
-    {
-        bool set_min = false;
-        int64_t minimum = INT64_MAX;
-        bool set_max = false;
-        int64_t maximum = INT64_MIN;
-        bool set_umax = false;
-        uint64_t umaximum = 0;
-        if (object->HasMember("minimum"))
-        {
-            assert((*object)["minimum"].IsInt64());
-            set_min = true;
-            minimum = (*object)["minimum"].GetInt64();
-        }
-        if (object->HasMember("maximum"))
+        else if constexpr (std::is_signed_v<T>)
         {
-            if ((*object)["maximum"].IsInt64())
+            if (value < node.int_minimum)
             {
-                set_max = true;
-                maximum = (*object)["maximum"].GetInt64();
+                return "minimum";
             }
-            else if ((*object)["maximum"].IsUint64())
+            if (value > node.int_maximum)
             {
-                set_max = true;
-                set_umax = true;
-                umaximum = (*object)["maximum"].GetUint64();
+                return "maximum";
             }
         }
-        if (object->HasMember("exclusiveMinimum"))
+        else
         {
-            if ((*object)["exclusiveMinimum"].IsInt64())
+            if (node.int_minimum > 0 && value < static_cast<uint64_t>(node.int_minimum))
             {
-                set_min = true;
-                minimum = (*object)["exclusiveMinimum"].GetInt64() + 1;
+                return "minimum";
             }
-            if ((*object)["exclusiveMinimum"].IsBool())
+            // values above INT64_MAX are only limited by a maximum below it
+            if (node.int_maximum < INT64_MAX && (node.int_maximum < 0 || value > static_cast<uint64_t>(node.int_maximum)))
             {
-                set_min = true;
-                if ((*object)["exclusiveMinimum"].GetBool())
-                {
-                    minimum++;
-                }
+                return "maximum";
             }
         }
-        if (object->HasMember("exclusiveMaximum"))
+        return nullptr;
+    }
+    // keyword of the JSON schema the string violates, nullptr if it is valid
+    static const char *invalidString(const schema_node &node, const char *str, SizeType length)
+    {
+        if (node.min_length > 0 || node.max_length < UINT64_MAX)
         {
-            if ((*object)["exclusiveMaximum"].IsInt64())
+            // the length counts characters, not the continuation bytes of UTF-8
+            uint64_t characters = 0;
+            for (SizeType i = 0; i < length; i++)
             {
-                if ((*object)["exclusiveMaximum"].IsInt64())
-                {
-                    set_max = true;
-                    maximum = (*object)["exclusiveMaximum"].GetInt64() - 1;
-                }
-                else if ((*object)["exclusiveMaximum"].IsUint64())
-                {
-                    set_max = true;
-                    set_umax = true;
-                    umaximum = (*object)["exclusiveMaximum"].GetUint64() - 1;
-                }
+                characters += (static_cast<uint8_t>(str[i]) & 0xC0) != 0x80;
             }
-            if ((*object)["exclusiveMaximum"].IsBool())
+            if (characters < node.min_length)
             {
-                if (set_max && (*object)["exclusiveMaximum"].GetBool())
-                {
-                    maximum--;
-                    umaximum--;
-                }
+                return "minLength";
             }
+            if (characters > node.max_length)
+            {
+                return "maxLength";
+            }
+        }
+        if (!node.enum_values.empty() &&
+            std::none_of(node.enum_values.begin(), node.enum_values.end(), [&](const string &allowed)
+                         { return allowed.size() == length && memcmp(allowed.data(), str, length) == 0; }))
+        {
+            return "enum";
         }
+        return nullptr;
+    }
 
-        // decide type based on maximum, exclusiveMaximum, minimum, exclusiveMinimum
+    bool Null()
+    {
+        if (skipping)
+        {
+            return skipEvent(0);
+        }
+        const schema_node &node = nodes[ctx->current_node];
+        int column_index = node.leaf_index;
 
-        // INT32, INT32_signed, INT64, INT64_signed
-        // skip INT8 and INT16 as parquet primitive type is minimum INT32
-        if (set_min && set_max)
+        if (column_index < 0)
         {
-            if (set_umax)
-            {
-                if (minimum >= 0 && umaximum <= UINT32_MAX)
-                {
-                    if (required)
-                    {
-                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
-                    }
-                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
-                }
-                if (minimum >= INT32_MIN && umaximum <= INT32_MAX)
-                {
-                    if (required)
-                    {
-                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
-                    }
-                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
-                }
-                if (minimum >= 0 && umaximum <= UINT64_MAX)
-                {
-                    if (required)
-                    {
-                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
-                    }
-                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
-                }
-            }
-            else
-            {
-                if (minimum >= 0 && maximum <= UINT32_MAX)
-                {
-                    if (required)
-                    {
-                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
-                    }
-                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
-                }
-                if (minimum >= INT32_MIN && maximum <= INT32_MAX)
-                {
-                    if (required)
-                    {
-                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
-                    }
-                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
-                }
-                if (minimum >= 0 && maximum <= UINT64_MAX)
-                {
-                    if (required)
-                    {
-                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
-                    }
-                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
-                }
-            }
-            // else use default
+            return nullGroup();
+        }
+        // null is only valid for type null or a nullable type, without validation it is accepted for every optional column
+        if (validate && !node.logical_null && !node.nullable)
+        {
+            return invalid("type");
         }
 
-        // default
-        if (required)
+        // check if column is required or has type null
+        if (node.is_required && !node.logical_null)
         {
-            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(64, true), parquet::Type::INT64);
+            return false;
         }
-        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(64, true), parquet::Type::INT64);
+        if (!node.where_comparisons.empty() && filterValue(node, nullptr))
+        {
+            return true;
+        }
+
+        ctx->parquet_data[column_index].definition_levels.push_back(node.definition_level - 1);
+        ctx->parquet_data[column_index].repetition_levels.push_back(rep_level(ctx));
+        ctx->batch_bytes += 2 * sizeof(int16_t);
+
+        if (node.is_element)
+        {
+            ctx->new_array = false;
+        }
+        ctx->new_key = false;
+        return true;
     }
-    else if (type == "number")
+    // null as the value of an optional object or array, its leaves get the same levels as if its key was missing
+    bool nullGroup()
     {
-        if (required)
+        int node_id = ctx->current_node;
+        const schema_node &node = nodes[node_id];
+        // rows and the items of lists can not be null
+        if (node.depth == 0 || node.is_element || node.is_required)
         {
-            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::Type::DOUBLE);
+            return false;
         }
-        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::Type::DOUBLE);
+        if (validate && !node.nullable)
+        {
+            return invalid("type");
+        }
+        // undo the key, the object still counts it as keyed so it is not missing at its end again
+        size_t child_bit = nodes[node.parent].child_bits + node.ordinal;
+        if (!key_defined_child)
+        {
+            ctx->defined_children[child_bit / 64] &= ~(uint64_t(1) << (child_bit % 64));
+        }
+        if (!key_defined_node)
+        {
+            ctx->defined_nodes[node_id / 64] &= ~(uint64_t(1) << (node_id % 64));
+        }
+        ctx->new_key = key_new_key;
+        ctx->current_node = node.parent;
+        bool result = missingChild(node_id);
+        ctx->current_node = node_id;
+        return result;
     }
-    else if (type == "boolean")
+    // a single row larger than row_flush_size is written in parts, its levels so far go to the row group now
+    bool flushLargeRow()
     {
-        if (required)
+        if (ctx->batch_bytes - ctx->row_begin_bytes < ctx->settings->row_flush_size)
         {
-            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::Type::BOOLEAN);
+            return true;
         }
-        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::Type::BOOLEAN);
+        if (ctx->settings->dead_letter || (where_root >= 0 && !row_matched))
+        {
+            // the row can fail or not match --where until it ends, then it is taken out of the batch as a whole
+            return true;
+        }
+        chargeMemory(ctx->settings, &ctx->charged_batch_bytes, batchMemory(ctx->parquet_data));
+        // the parts of a huge row do not pile up in front of the writer
+        if (memoryExceeded(ctx->settings))
+        {
+            waitForMemory(ctx);
+        }
+        if (!finishBatch(ctx, false, true))
+        {
+            return false;
+        }
+        ctx->row_begin_bytes = 0;
+        ctx->row_flushed = true;
+        return true;
     }
-    else if (type == "null")
+    // add the levels of a value appended to the leaf of the current node
+    bool appendLevels(const schema_node &node, size_t value_bytes)
     {
-        if (required)
+        ctx->parquet_data[node.leaf_index].definition_levels.push_back(node.definition_level);
+        ctx->parquet_data[node.leaf_index].repetition_levels.push_back(rep_level(ctx));
+        ctx->batch_bytes += 2 * sizeof(int16_t) + value_bytes;
+
+        if (node.is_element)
         {
-            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Null(), parquet::Type::UNDEFINED);
+            ctx->new_array = false;
         }
-        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Null(), parquet::Type::UNDEFINED);
+        ctx->new_key = false;
+        return flushLargeRow();
     }
-
-    throw runtime_error("Unsupported type: " + type);
-}
-
-static std::pair<std::shared_ptr<GroupNode>, map<string, int>> SetupParquetSchema(Document *schema_doc)
-{
-    parquet::schema::NodeVector fields;
-
-    // https://github.com/apache/parquet-format/blob/master/LogicalTypes.md
-    // https://github.com/apache/arrow/blob/main/cpp/src/parquet/schema.cc
-
-    // expect the schema JSON to start like this:
-    // {
-    //     "$schema": <any schema url>,
-    //     "type": "array",
-    //     "items": {
-    //         "type": "object",
-    //         "required": [<required fields>],
-    //         "properties": {
-    //             "<key>": {
-    //                 "type": <type>
-    //             }
-    //         }
-    //     }
-    // }
-
-    assert(schema_doc->IsObject());
-    assert(schema_doc->HasMember("type"));
-    assert((*schema_doc)["type"].IsString());
-    assert((string)(*schema_doc)["type"].GetString() == "array");
-
-    assert(schema_doc->HasMember("items"));
-    assert((*schema_doc)["items"].IsObject());
-    auto items = (*schema_doc)["items"].GetObject();
-
-    assert(items.HasMember("type"));
-    assert(items["type"].IsString());
-    assert((string)items["type"].GetString() == "object");
-
-    // iterate over all members of properties, keys are column names, values are types
-    // do this recursively for nested types
-
-    vector<string> required_fields;
-    if (items.HasMember("required"))
+    // T selects the value buffer of the column
+    template <typename T>
+    bool appendValue(const schema_node &node, T value)
     {
-        assert(items["required"].IsArray());
-        for (auto &req : items["required"].GetArray())
+        if (!node.where_comparisons.empty() && filterValue(node, value))
         {
-            required_fields.push_back((string)req.GetString());
+            return true;
+        }
+        column &column_data = ctx->parquet_data[node.leaf_index];
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            column_data.bool_values.push_back(value);
+        }
+        else if constexpr (std::is_same_v<T, int32_t>)
+        {
+            column_data.int32_values.push_back(value);
+        }
+        else if constexpr (std::is_same_v<T, int64_t>)
+        {
+            column_data.int64_values.push_back(value);
+        }
+        else
+        {
+            static_assert(std::is_same_v<T, double>);
+            column_data.double_values.push_back(value);
         }
+        return appendLevels(node, sizeof(T));
     }
-
-    assert(items.HasMember("properties"));
-    assert(items["properties"].IsObject());
-    for (auto &prop : items["properties"].GetObject())
+    // JSON integers fit INT32 and INT64 columns and are converted for DOUBLE columns
+    // be careful with type (IntType(size, bool_signed)), values that need 64 bits never go to INT32
+    template <typename T>
+    bool appendInteger(T i)
     {
-        string member_key = prop.name.GetString();
-        rapidjson::Value::Object member_value = prop.value.GetObject();
-
-        if (std::find(required_fields.begin(), required_fields.end(), member_key) != required_fields.end())
+        if (skipping)
+        {
+            return skipEvent(0);
+        }
+        const schema_node &node = nodes[ctx->current_node];
+        if (validate && node.check_value)
+        {
+            const char *keyword = node.kind == value_kind::real ? outOfRange(node, static_cast<double>(i)) : outOfRange(node, i);
+            if (keyword != nullptr)
+            {
+                return invalid(keyword);
+            }
+        }
+        switch (node.kind)
+        {
+        case value_kind::int32:
+            if constexpr (sizeof(T) > sizeof(int32_t))
+            {
+                return false;
+            }
+            return appendValue(node, static_cast<int32_t>(i));
+        case value_kind::int64:
+            return appendValue(node, static_cast<int64_t>(i));
+        case value_kind::real:
+            return appendValue(node, static_cast<double>(i));
+        default:
+            return false;
+        }
+    }
+    bool Bool(bool b)
+    {
+        if (skipping)
+        {
+            return skipEvent(0);
+        }
+        const schema_node &node = nodes[ctx->current_node];
+        if (node.kind != value_kind::boolean)
         {
-            fields.push_back(createNode(member_key, &member_value, true));
+            return false;
+        }
+        return appendValue(node, b);
+    }
+    bool Int(int i)
+    {
+        return appendInteger(i);
+    }
+    bool Uint(unsigned u)
+    {
+        return appendInteger(u);
+    }
+    bool Int64(int64_t i)
+    {
+        return appendInteger(i);
+    }
+    bool Uint64(uint64_t u)
+    {
+        return appendInteger(u);
+    }
+    bool Double(double d)
+    {
+        if (skipping)
+        {
+            return skipEvent(0);
+        }
+        const schema_node &node = nodes[ctx->current_node];
+        if (node.kind != value_kind::real)
+        {
+            return false;
+        }
+        if (validate && node.check_value)
+        {
+            if (const char *keyword = outOfRange(node, d))
+            {
+                return invalid(keyword);
+            }
+        }
+        return appendValue(node, d);
+    }
+    bool String(const char *str, SizeType length, bool copy)
+    {
+        // String should also contain/differ between other types and normal string
+        // date, transform into INT32
+        // timestamp, transform into INT64
+        if (skipping)
+        {
+            return skipEvent(0);
+        }
+        const schema_node &node = nodes[ctx->current_node];
+        if (node.kind == value_kind::date)
+        {
+            // transform string into INT32 (num of days from unix epoch, 01.01.1970)
+            int32_t daysSinceEpoch;
+            if (!parseDate(str, length, &daysSinceEpoch))
+            {
+                return invalid("format");
+            }
+            return appendValue(node, daysSinceEpoch);
+        }
+        if (node.kind == value_kind::timestamp)
+        {
+            // transform string into INT64 (time since unix epoch in UTC)
+            int64_t timestamp;
+            if (!parseTimestamp(str, length, node.units_per_second, &timestamp))
+            {
+                return invalid("format");
+            }
+            return appendValue(node, timestamp);
+        }
+        if (node.kind == value_kind::time)
+        {
+            // transform string into INT64 (time of day in UTC)
+            int64_t time;
+            if (!parseTime(str, length, node.units_per_second, &time))
+            {
+                return invalid("format");
+            }
+            int64_t day = 24 * 60 * 60 * node.units_per_second;
+            time %= day;
+            return appendValue(node, time < 0 ? time + day : time);
+        }
+        if (node.kind != value_kind::string)
+        {
+            return false;
+        }
+        if (validate && node.check_value)
+        {
+            if (const char *keyword = invalidString(node, str, length))
+            {
+                return invalid(keyword);
+            }
+        }
+        if (!node.where_comparisons.empty() && filterValue(node, string_view(str, length)))
+        {
+            return true;
+        }
+
+        column &column_data = ctx->parquet_data[node.leaf_index];
+        if (copy)
+        {
+            column_data.byte_array_values.push_back(parquet::ByteArray(length, column_data.string_values.append(str, length)));
+        }
+        else
+        {
+            // in situ parsing, the string stays valid in the input buffer until the last batch is written
+            column_data.byte_array_values.push_back(parquet::ByteArray(length, reinterpret_cast<const uint8_t *>(str)));
+        }
+        return appendLevels(node, length);
+    }
+    bool StartObject()
+    {
+        if (skipping)
+        {
+            return skipEvent(1);
+        }
+        // a row is an object in the array of rows, or directly the document
+        if (validate && ctx->current_node == 0 && in_root_array != ctx->settings->rows_in_array)
+        {
+            return invalid("type");
+        }
+        ctx->new_object = true;
+
+        return true;
+    }
+    bool Key(const char *str, SizeType length, bool copy)
+    {
+        if (skipping)
+        {
+            return skipEvent(0);
+        }
+        if (ctx->new_object)
+        {
+            ctx->new_object = false;
+        }
+        else
+        {
+            // leave the previous key of this object
+            ctx->current_node = nodes[ctx->current_node].parent;
+        }
+
+        int child = findChild(nodes, ctx->current_node, str, length);
+        if (child < 0)
+        {
+            // fail parser if field not found, unless its columns are not selected
+            if (skipKey(str, length))
+            {
+                return true;
+            }
+            return validate && nodes[ctx->current_node].no_additional_properties ? invalid("additionalProperties") : false;
+        }
+        const schema_node &node = nodes[child];
+        size_t child_bit = nodes[ctx->current_node].child_bits + node.ordinal;
+        if (node.is_group)
+        {
+            key_defined_child = testBit(ctx->defined_children, child_bit);
+            key_defined_node = testBit(ctx->defined_nodes, child);
+            key_new_key = ctx->new_key;
+        }
+        setBit(ctx->defined_children, child_bit);
+        setBit(ctx->keyed_children, child_bit);
+        ctx->current_node = child;
+
+        if (!testBit(ctx->defined_nodes, child))
+        {
+            ctx->new_key = true;
+        }
+        setBit(ctx->defined_nodes, child);
+        int index = node.leaf_index;
+        // only add leaf keys
+        if (index >= 0)
+        {
+            ctx->found_leaves[index] = ctx->row_stamp;
+        }
+
+        return true;
+    }
+
+    bool checkChildren(int node_id, bool req_parent = false)
+    {
+        const schema_node &node = nodes[node_id];
+        const schema_node *parent = &nodes[node.parent];
+        setBit(ctx->defined_nodes, node_id);
+        // still on path and not leaf
+        if (node.is_group)
+        {
+            // parent is required, so all required children need to be defined
+            // parent required AND required AND undefined
+            if (req_parent &&
+                node.is_required &&
+                !testBit(ctx->defined_children, parent->child_bits + node.ordinal))
+            {
+                return false;
+            }
+            bool no_error = true;
+            bool req_fields_defined = true;
+            for (int child : node.children)
+            {
+                const schema_node &child_node = nodes[child];
+                no_error = no_error && checkChildren(child, node.is_required);
+                // for each node on path check required
+                // if required, then fail parser if any required child is missing
+                if (child_node.is_required)
+                {
+                    req_fields_defined = req_fields_defined &&
+                                         child_node.uncle_ordinal >= 0 &&
+                                         testBit(ctx->defined_children, parent->child_bits + child_node.uncle_ordinal);
+                }
+            }
+            clearChildren(ctx->defined_children, node);
+            if (req_parent && !req_fields_defined)
+            {
+                return false;
+            }
+            return no_error;
+        }
+
+        // reached leaf
+        int leaf_index = node.leaf_index;
+
+        if (ctx->found_leaves[leaf_index] != ctx->row_stamp)
+        {
+            // not found in keys of this row
+            // should only be checked if all parents are also required
+            if (node.all_required)
+            {
+                // leaf not found but is required
+                return false;
+            }
+            ctx->found_leaves[leaf_index] = ctx->row_stamp;
+        }
+
+        // get correct child, if element take the child of the current node on the leaf path
+        const schema_node &current = nodes[ctx->current_node];
+        int ordinal = node.ordinal;
+        if (node.is_element)
+        {
+            int ancestor = node_id;
+            while (nodes[ancestor].depth > current.depth + 1)
+            {
+                ancestor = nodes[ancestor].parent;
+            }
+            ordinal = nodes[ancestor].ordinal;
+            parent = &current;
+        }
+
+        // new key in this object
+        size_t child_bit = parent->child_bits + ordinal;
+        if (!testBit(ctx->defined_children, child_bit))
+        {
+            ctx->new_key = true;
+            setBit(ctx->defined_children, child_bit);
+        }
+
+        ctx->parquet_data[leaf_index].definition_levels.push_back(current.definition_level);
+        ctx->parquet_data[leaf_index].repetition_levels.push_back(rep_level(ctx));
+        ctx->batch_bytes += 2 * sizeof(int16_t);
+        ctx->new_key = false;
+        ctx->new_array = false;
+
+        return true;
+    }
+
+    // child of the current node that is missing in its object, add a null value to all its leaves
+    // same result as checkChildren: a leaf starts a new key if it is not defined in its parent,
+    // the node itself and list elements only once in the current object
+    bool missingChild(int node_id)
+    {
+        const schema_node &node = nodes[node_id];
+        if (node.missing_needs_check)
+        {
+            return checkChildren(node_id);
+        }
+        const schema_node &current = nodes[ctx->current_node];
+        size_t child_bit = current.child_bits + node.ordinal;
+        setBits(ctx->defined_nodes, node_id, node.subtree_size);
+        for (int leaf_id : node.missing_leaves)
+        {
+            const schema_node &leaf = nodes[leaf_id];
+            if (ctx->found_leaves[leaf.leaf_index] != ctx->row_stamp)
+            {
+                if (leaf.all_required)
+                {
+                    // leaf not found but is required
+                    return false;
+                }
+                ctx->found_leaves[leaf.leaf_index] = ctx->row_stamp;
+            }
+            if (leaf_id != node_id && !leaf.is_element)
+            {
+                if (!testBit(ctx->defined_children, nodes[leaf.parent].child_bits + leaf.ordinal))
+                {
+                    ctx->new_key = true;
+                }
+            }
+            else if (!testBit(ctx->defined_children, child_bit))
+            {
+                ctx->new_key = true;
+                setBit(ctx->defined_children, child_bit);
+            }
+            ctx->parquet_data[leaf.leaf_index].definition_levels.push_back(current.definition_level);
+            ctx->parquet_data[leaf.leaf_index].repetition_levels.push_back(rep_level(ctx));
+            ctx->new_key = false;
+            ctx->new_array = false;
+        }
+        ctx->batch_bytes += 2 * sizeof(int16_t) * node.missing_leaves.size();
+        // checkChildren forgets the defined children of every group in the subtree
+        std::fill(ctx->defined_children.begin() + node.child_bits / 64,
+                  ctx->defined_children.begin() + (node.child_bits + node.subtree_child_bits) / 64, 0);
+        return true;
+    }
+
+    bool EndObject(SizeType memberCount)
+    {
+        if (skipping)
+        {
+            skipEvent(-1);
+            // the root object of a row that does not match --where ends
+            if (!skipping && row_rejected)
+            {
+                dropRow();
+            }
+            return true;
+        }
+        // end of object, so remove key from stack (last key within object, only while nested)
+        // a skipped last key was never put on it
+        if (memberCount > 0 && !ctx->new_object)
+        {
+            ctx->current_node = nodes[ctx->current_node].parent;
+        }
+
+        ctx->new_object = false;
+        ctx->new_array = false;
+
+        const schema_node &current = nodes[ctx->current_node];
+
+        if (!current.is_group)
+        {
+            // should be group, otherwise no object
+            // something is wrong, fail parser
+            return false;
+        }
+
+        bool root_result = true;
+
+        if (validate && !current.required_children.empty())
+        {
+            size_t first_word = current.child_bits / 64;
+            for (size_t word = 0; word < current.required_children.size(); word++)
+            {
+                if (current.required_children[word] & ~ctx->keyed_children[first_word + word])
+                {
+                    return invalid("required");
+                }
+            }
+        }
+
+        // check if fields are missing, otherwise done with object
+        // skipped keys are counted in memberCount too
+        if (memberCount != current.children.size() || !current.skipped_children.empty())
+        {
+            // missing children are neither a key of this object nor already defined in it
+            // -> checkChildren for all missing ones, word by word
+            // checkChildren only changes the bit of the child it checks, so the masks stay valid
+            size_t first_word = current.child_bits / 64;
+            for (size_t word = 0; word * 64 < current.children.size(); word++)
+            {
+                uint64_t missing = ~ctx->keyed_children[first_word + word];
+                // if parent is list, ignore the defined children
+                if (ctx->current_node == 0 || !current.parent_is_list)
+                {
+                    missing &= ~ctx->defined_children[first_word + word];
+                }
+                size_t children_left = current.children.size() - word * 64;
+                if (children_left < 64)
+                {
+                    missing &= (uint64_t(1) << children_left) - 1;
+                }
+                while (missing)
+                {
+                    int bit = __builtin_ctzll(missing);
+                    missing &= missing - 1;
+                    // iterate over children (DFS, children of children)
+                    root_result = root_result && missingChild(current.children[word * 64 + bit]);
+                }
+            }
+        }
+
+        // json should be array of rows -> each row is one object
+        // if EndObject is also end of row:
+        if (ctx->current_node == 0) // only root at end of row
+        {
+            if (!root_result)
+            {
+                // a row with missing required fields is not finished, it stays out of the batch
+                return false;
+            }
+            if (where_root >= 0)
+            {
+                // leaves that never appeared in the row are null
+                if (!row_matched && evaluate(where_root, true) != truth::yes)
+                {
+                    dropRow();
+                    return true;
+                }
+                startRowFilter();
+            }
+            ctx->row_flushed = false;
+            // forget the found leaves of this row
+            ctx->row_stamp++;
+            std::fill(ctx->defined_nodes.begin(), ctx->defined_nodes.end(), 0);
+
+            ctx->batch_rows++;
+            chargeMemory(ctx->settings, &ctx->charged_batch_bytes, batchMemory(ctx->parquet_data));
+            if (memoryExceeded(ctx->settings))
+            {
+                // the writers release memory, the batch is only written early if that does not help
+                waitForMemory(ctx);
+            }
+            // write the batch when it is full, the row group reached its maximum number of rows or the memory budget is used up
+            if (ctx->batch_rows >= ctx->settings->batch_size ||
+                ctx->batch_bytes >= ctx->settings->batch_byte_size ||
+                ctx->row_count + ctx->batch_rows >= ctx->settings->num_rows_per_row_group ||
+                (memoryExceeded(ctx->settings) && batchOverShare(ctx)))
+            {
+                if (!finishBatch(ctx))
+                {
+                    return false;
+                }
+            }
+            ctx->row_begin_bytes = ctx->batch_bytes;
+            if (!ctx->row_begin_levels.empty())
+            {
+                for (size_t i = 0; i < ctx->row_begin_levels.size(); i++)
+                {
+                    ctx->row_begin_levels[i] = ctx->parquet_data[i].definition_levels.size();
+                    ctx->row_begin_values[i] = ctx->parquet_data[i].valueCount();
+                }
+            }
+        }
+        else
+        {
+            root_result = root_result && flushLargeRow();
+        }
+
+        // need to keep entry within array but delete at end of array
+        // only delete if current_path is not repeated
+        if (ctx->current_node == 0 || !current.parent_is_list)
+        {
+            clearChildren(ctx->defined_children, current);
+        }
+        clearChildren(ctx->keyed_children, current);
+        return root_result;
+    }
+    bool StartArray()
+    {
+        if (skipping)
+        {
+            return skipEvent(1);
+        }
+        if (ctx->current_node == 0)
+        {
+            // only the rows of a JSON input are in an array, arrays in it are no rows
+            if (validate && (!ctx->settings->rows_in_array || in_root_array))
+            {
+                return invalid("type");
+            }
+            in_root_array = true;
+        }
+        // check if current field is repeated
+        if (ctx->current_node != 0)
+        {
+            int list = findChild(nodes, ctx->current_node, "list", 4);
+            // fail if field is not repeated
+            if (list < 0 || !nodes[list].is_repeated)
+            {
+                return false;
+            }
+            int element = findChild(nodes, list, "element", 7);
+            if (element < 0)
+            {
+                return false;
+            }
+            ctx->current_node = element;
+            // neither list nor element in defined
+            if (!testBit(ctx->defined_nodes, list) && !testBit(ctx->defined_nodes, element))
+            {
+                ctx->new_key = true;
+            }
+            // add [...].list to defined but not element
+            setBit(ctx->defined_nodes, list);
+
+            if (!ctx->new_array)
+            {
+                ctx->new_array_depth = ctx->repeated_count;
+            }
+            ctx->repeated_count++;
+            ctx->new_array = true;
+            int index = nodes[element].leaf_index;
+            // only add leaf keys
+            if (index >= 0)
+            {
+                ctx->found_leaves[index] = ctx->row_stamp;
+            }
+        }
+        return true;
+    }
+    bool EndArray(SizeType elementCount)
+    {
+        if (skipping)
+        {
+            return skipEvent(-1);
+        }
+        bool root_result = true;
+        if (ctx->current_node == 0)
+        {
+            in_root_array = false;
+        }
+        if (ctx->current_node != 0)
+        {
+            const schema_node &element = nodes[ctx->current_node];
+            if (elementCount > 0)
+            {
+                // there are actual elements in the array
+                // add [...].element to defined
+                setBit(ctx->defined_nodes, ctx->current_node);
+            }
+            // remove "element" and "list"
+            ctx->current_node = nodes[element.parent].parent;
+            const schema_node &current = nodes[ctx->current_node];
+            if (validate && current.check_value && (elementCount < current.min_length || elementCount > current.max_length))
+            {
+                return invalid(elementCount < current.min_length ? "minItems" : "maxItems");
+            }
+            if (elementCount == 0)
+            {
+                int column_index = element.leaf_index;
+                if (column_index >= 0)
+                {
+                    ctx->parquet_data[column_index].definition_levels.push_back(current.definition_level);
+                    ctx->parquet_data[column_index].repetition_levels.push_back(rep_level(ctx));
+                    ctx->batch_bytes += 2 * sizeof(int16_t);
+                    ctx->new_key = false;
+                    ctx->new_array = false;
+                }
+                else
+                {
+                    // array is not leaf -> add def, rep for all leaves
+                    // check if fields are missing, otherwise done with object
+                    // get all root keys
+                    // -> checkChildren for all missing ones
+                    for (int child : current.children)
+                    {
+                        root_result = root_result && missingChild(child);
+                    }
+                }
+            }
+            ctx->repeated_count--;
+            clearChildren(ctx->defined_children, element);
+            clearChildren(ctx->keyed_children, element);
+            root_result = root_result && flushLargeRow();
+        }
+        return root_result;
+    }
+};
+
+// the type of a JSON schema, for a nullable type like ["integer", "null"] the type besides null
+// "" for a union of several other types
+static string schemaType(const rapidjson::Value &type)
+{
+    if (type.IsString())
+    {
+        return type.GetString();
+    }
+    string result;
+    bool has_null = false;
+    if (type.IsArray())
+    {
+        for (auto &entry : type.GetArray())
+        {
+            if (!entry.IsString())
+            {
+                return "";
+            }
+            if ((string)entry.GetString() == "null")
+            {
+                has_null = true;
+                continue;
+            }
+            if (!result.empty())
+            {
+                return "";
+            }
+            result = entry.GetString();
+        }
+    }
+    return result.empty() && has_null ? "null" : result;
+}
+
+static std::shared_ptr<parquet::schema::Node> createNode(string key, rapidjson::Value::Object *object, bool required, parquet::LogicalType::TimeUnit::unit time_unit)
+{
+    assert(object->HasMember("type"));
+    string type = schemaType((*object)["type"]);
+    if (type == "array")
+    {
+        assert(object->HasMember("items"));
+        assert((*object)["items"].IsObject());
+        auto items = (*object)["items"].GetObject();
+        auto array_element = createNode("element", &items, false, time_unit);
+
+        parquet::schema::NodeVector list_element;
+        list_element.push_back(array_element);
+        auto array = GroupNode::Make("list", Repetition::REPEATED, list_element);
+
+        parquet::schema::NodeVector list_elements;
+        list_elements.push_back(array);
+
+        if (required)
+        {
+            return GroupNode::Make(key, Repetition::REQUIRED, list_elements, parquet::LogicalType::List());
+        }
+
+        return GroupNode::Make(key, Repetition::OPTIONAL, list_elements, parquet::LogicalType::List());
+    }
+    else if (type == "object")
+    {
+        parquet::schema::NodeVector column_object;
+
+        vector<string> required_fields;
+        if (object->HasMember("required"))
+        {
+            assert((*object)["required"].IsArray());
+            for (auto &req : (*object)["required"].GetArray())
+            {
+                required_fields.push_back((string)req.GetString());
+            }
+        }
+
+        assert(object->HasMember("properties"));
+        assert((*object)["properties"].IsObject());
+        for (auto &prop : (*object)["properties"].GetObject())
+        {
+            string member_key = prop.name.GetString();
+            rapidjson::Value::Object member_value = prop.value.GetObject();
+
+            if (std::find(required_fields.begin(), required_fields.end(), member_key) != required_fields.end())
+            {
+                column_object.push_back(createNode(member_key, &member_value, true, time_unit));
+            }
+            else
+            {
+                column_object.push_back(createNode(member_key, &member_value, false, time_unit));
+            }
+        }
+
+        if (required)
+        {
+            return GroupNode::Make(key, Repetition::REQUIRED, column_object);
+        }
+        return GroupNode::Make(key, Repetition::OPTIONAL, column_object);
+    }
+    else if (type == "string")
+    {
+        // check format
+        if (object->HasMember("format"))
+        {
+            assert((*object)["format"].IsString());
+            string format = (*object)["format"].GetString();
+            if (format == "date")
+            {
+                if (required)
+                {
+                    return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Date(), parquet::Type::INT32);
+                }
+                return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Date(), parquet::Type::INT32);
+            }
+            // date-time and time are stored in UTC, offsets are applied while parsing
+            if (format == "date-time")
+            {
+                if (required)
+                {
+                    return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Timestamp(true, time_unit), parquet::Type::INT64);
+                }
+                return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Timestamp(true, time_unit), parquet::Type::INT64);
+            }
+            if (format == "time")
+            {
+                if (required)
+                {
+                    return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Time(true, time_unit), parquet::Type::INT64);
+                }
+                return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Time(true, time_unit), parquet::Type::INT64);
+            }
+        }
+        if (required)
+        {
+            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::String(), parquet::Type::BYTE_ARRAY);
+        }
+        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::String(), parquet::Type::BYTE_ARRAY);
+    }
+    else if (type == "integer")
+    {
+        bool set_min = false;
+        int64_t minimum = INT64_MAX;
+        bool set_max = false;
+        int64_t maximum = INT64_MIN;
+        bool set_umax = false;
+        uint64_t umaximum = 0;
+        if (object->HasMember("minimum"))
+        {
+            assert((*object)["minimum"].IsInt64());
+            set_min = true;
+            minimum = (*object)["minimum"].GetInt64();
+        }
+        if (object->HasMember("maximum"))
+        {
+            if ((*object)["maximum"].IsInt64())
+            {
+                set_max = true;
+                maximum = (*object)["maximum"].GetInt64();
+            }
+            else if ((*object)["maximum"].IsUint64())
+            {
+                set_max = true;
+                set_umax = true;
+                umaximum = (*object)["maximum"].GetUint64();
+            }
+        }
+        if (object->HasMember("exclusiveMinimum"))
+        {
+            if ((*object)["exclusiveMinimum"].IsInt64())
+            {
+                set_min = true;
+                minimum = (*object)["exclusiveMinimum"].GetInt64() + 1;
+            }
+            if ((*object)["exclusiveMinimum"].IsBool())
+            {
+                set_min = true;
+                if ((*object)["exclusiveMinimum"].GetBool())
+                {
+                    minimum++;
+                }
+            }
+        }
+        if (object->HasMember("exclusiveMaximum"))
+        {
+            if ((*object)["exclusiveMaximum"].IsInt64())
+            {
+                if ((*object)["exclusiveMaximum"].IsInt64())
+                {
+                    set_max = true;
+                    maximum = (*object)["exclusiveMaximum"].GetInt64() - 1;
+                }
+                else if ((*object)["exclusiveMaximum"].IsUint64())
+                {
+                    set_max = true;
+                    set_umax = true;
+                    umaximum = (*object)["exclusiveMaximum"].GetUint64() - 1;
+                }
+            }
+            if ((*object)["exclusiveMaximum"].IsBool())
+            {
+                if (set_max && (*object)["exclusiveMaximum"].GetBool())
+                {
+                    maximum--;
+                    umaximum--;
+                }
+            }
+        }
+
+        // decide type based on maximum, exclusiveMaximum, minimum, exclusiveMinimum
+
+        // INT32, INT32_signed, INT64, INT64_signed
+        // skip INT8 and INT16 as parquet primitive type is minimum INT32
+        if (set_min && set_max)
+        {
+            if (set_umax)
+            {
+                if (minimum >= 0 && umaximum <= UINT32_MAX)
+                {
+                    if (required)
+                    {
+                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
+                    }
+                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
+                }
+                if (minimum >= INT32_MIN && umaximum <= INT32_MAX)
+                {
+                    if (required)
+                    {
+                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
+                    }
+                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
+                }
+                if (minimum >= 0 && umaximum <= UINT64_MAX)
+                {
+                    if (required)
+                    {
+                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
+                    }
+                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
+                }
+            }
+            else
+            {
+                if (minimum >= 0 && maximum <= UINT32_MAX)
+                {
+                    if (required)
+                    {
+                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
+                    }
+                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, false), parquet::Type::INT32);
+                }
+                if (minimum >= INT32_MIN && maximum <= INT32_MAX)
+                {
+                    if (required)
+                    {
+                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
+                    }
+                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(32, true), parquet::Type::INT32);
+                }
+                if (minimum >= 0 && maximum <= UINT64_MAX)
+                {
+                    if (required)
+                    {
+                        return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
+                    }
+                    return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(64, false), parquet::Type::INT64);
+                }
+            }
+            // else use default
+        }
+
+        // default
+        if (required)
+        {
+            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Int(64, true), parquet::Type::INT64);
+        }
+        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Int(64, true), parquet::Type::INT64);
+    }
+    else if (type == "number")
+    {
+        if (required)
+        {
+            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::Type::DOUBLE);
+        }
+        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::Type::DOUBLE);
+    }
+    else if (type == "boolean")
+    {
+        if (required)
+        {
+            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::Type::BOOLEAN);
+        }
+        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::Type::BOOLEAN);
+    }
+    else if (type == "null")
+    {
+        if (required)
+        {
+            return PrimitiveNode::Make(key, Repetition::REQUIRED, parquet::LogicalType::Null(), parquet::Type::UNDEFINED);
+        }
+        return PrimitiveNode::Make(key, Repetition::OPTIONAL, parquet::LogicalType::Null(), parquet::Type::UNDEFINED);
+    }
+
+    throw runtime_error("Unsupported type: " + type);
+}
+
+// keep the nodes on the paths to the selected columns, a selected group keeps all columns below it
+// the names of the children that are left out are collected for each group by its path
+static parquet::schema::NodePtr selectColumns(const parquet::schema::NodePtr &node, const string &path, const vector<string> &columns, map<string, vector<string>> *skipped)
+{
+    bool below = path.empty();
+    for (const string &column : columns)
+    {
+        if (column == path)
+        {
+            return node;
+        }
+        below = below || (column.size() > path.size() && column.compare(0, path.size(), path) == 0 && column[path.size()] == '.');
+    }
+    if (!below || !node->is_group())
+    {
+        return nullptr;
+    }
+    std::shared_ptr<GroupNode> group = std::static_pointer_cast<GroupNode>(node);
+    parquet::schema::NodeVector fields;
+    for (int i = 0; i < group->field_count(); i++)
+    {
+        const string &name = group->field(i)->name();
+        parquet::schema::NodePtr selected = selectColumns(group->field(i), path.empty() ? name : path + "." + name, columns, skipped);
+        if (selected)
+        {
+            fields.push_back(selected);
+        }
+        else
+        {
+            (*skipped)[path].push_back(name);
+        }
+    }
+    if (fields.empty())
+    {
+        return nullptr;
+    }
+    return GroupNode::Make(node->name(), node->repetition(), fields, node->converted_type(), node->field_id());
+}
+
+static std::pair<std::shared_ptr<GroupNode>, vector<schema_node>> SetupParquetSchema(Document *schema_doc, parquet::LogicalType::TimeUnit::unit time_unit, const vector<string> &columns)
+{
+    parquet::schema::NodeVector fields;
+
+    // https://github.com/apache/parquet-format/blob/master/LogicalTypes.md
+    // https://github.com/apache/arrow/blob/main/cpp/src/parquet/schema.cc
+
+    // expect the schema JSON to start like this:
+    // {
+    //     "$schema": <any schema url>,
+    //     "type": "array",
+    //     "items": {
+    //         "type": "object",
+    //         "required": [<required fields>],
+    //         "properties": {
+    //             "<key>": {
+    //                 "type": <type>
+    //             }
+    //         }
+    //     }
+    // }
+    // or for NDJSON input directly with the object schema of one row
+
+    assert(schema_doc->IsObject());
+    assert(schema_doc->HasMember("type"));
+    string root_type = schemaType((*schema_doc)["type"]);
+    assert(root_type == "array" || root_type == "object");
+
+    if (root_type == "array")
+    {
+        assert(schema_doc->HasMember("items"));
+        assert((*schema_doc)["items"].IsObject());
+    }
+    auto items = root_type == "array" ? (*schema_doc)["items"].GetObject() : schema_doc->GetObject();
+
+    assert(items.HasMember("type"));
+    assert(schemaType(items["type"]) == "object");
+
+    // iterate over all members of properties, keys are column names, values are types
+    // do this recursively for nested types
+
+    vector<string> required_fields;
+    if (items.HasMember("required"))
+    {
+        assert(items["required"].IsArray());
+        for (auto &req : items["required"].GetArray())
+        {
+            required_fields.push_back((string)req.GetString());
+        }
+    }
+
+    assert(items.HasMember("properties"));
+    assert(items["properties"].IsObject());
+    for (auto &prop : items["properties"].GetObject())
+    {
+        string member_key = prop.name.GetString();
+        rapidjson::Value::Object member_value = prop.value.GetObject();
+
+        if (std::find(required_fields.begin(), required_fields.end(), member_key) != required_fields.end())
+        {
+            fields.push_back(createNode(member_key, &member_value, true, time_unit));
+        }
+        else
+        {
+            fields.push_back(createNode(member_key, &member_value, false, time_unit));
+        }
+    }
+
+    // Create a GroupNode named 'schema' using the primitive nodes defined above
+    // This GroupNode is the root node of the schema tree
+    std::shared_ptr<parquet::schema::Node> root = GroupNode::Make("schema", Repetition::REQUIRED, fields);
+
+    // with --columns only the selected columns are converted, the values of the others are skipped
+    // columns that are not in the schema are reported by the caller
+    map<string, vector<string>> skipped;
+    if (!columns.empty())
+    {
+        parquet::schema::NodePtr selected = selectColumns(root, "", columns, &skipped);
+        if (selected)
+        {
+            root = selected;
+        }
+        else
+        {
+            skipped.clear();
+        }
+    }
+
+    std::shared_ptr<GroupNode> group_root = std::static_pointer_cast<GroupNode>(root);
+
+    // go through complete schema and compile the node table for the handler
+    vector<schema_node> schema_nodes;
+    int leaf_count = 0;
+    size_t child_bits = 0;
+    compileSchemaNode(group_root, -1, &schema_nodes, &leaf_count, &child_bits);
+    for (schema_node &node : schema_nodes)
+    {
+        auto it = skipped.find(node.path);
+        if (node.is_group && it != skipped.end())
+        {
+            node.skipped_children = it->second;
+            std::sort(node.skipped_children.begin(), node.skipped_children.end());
+        }
+    }
+
+    return {group_root, schema_nodes};
+}
+
+// integer bound of a JSON schema number, rounded into the values allowed by it
+static int64_t integerBound(const rapidjson::Value &bound, bool lower, bool exclusive)
+{
+    if (bound.IsInt64())
+    {
+        int64_t value = bound.GetInt64();
+        if (exclusive && lower && value < INT64_MAX)
+        {
+            return value + 1;
+        }
+        if (exclusive && !lower && value > INT64_MIN)
+        {
+            return value - 1;
+        }
+        return value;
+    }
+    double value = bound.GetDouble();
+    double rounded = lower ? (exclusive ? std::floor(value) + 1 : std::ceil(value)) : (exclusive ? std::ceil(value) - 1 : std::floor(value));
+    return rounded <= -9.2e18 ? INT64_MIN : rounded >= 9.2e18 ? INT64_MAX : static_cast<int64_t>(rounded);
+}
+
+// compile the keywords of the JSON schema of a node into the node table, so the handler validates while shredding
+// returns the first keyword that cannot be checked that way, "" when the whole subschema is compiled
+static string compileValidation(const rapidjson::Value &schema, int node_id, vector<schema_node> *nodes, const string &pointer)
+{
+    schema_node &node = (*nodes)[node_id];
+    node.schema_pointer = pointer;
+    for (auto &member : schema.GetObject())
+    {
+        string keyword = member.name.GetString();
+        const rapidjson::Value &value = member.value;
+        if (keyword == "$schema" || keyword == "$id" || keyword == "$comment" || keyword == "title" ||
+            keyword == "description" || keyword == "default" || keyword == "examples" || keyword == "format")
+        {
+            // date, date-time and time are checked by their parsers, other formats are not validated by rapidjson either
+            continue;
+        }
+        if (keyword == "type" && value.IsString())
+        {
+            // the handler only accepts values of the column type
+            continue;
+        }
+        if (keyword == "type" && value.IsArray() && value.Size() == 2 && schemaType(value) != "" && schemaType(value) != "null")
+        {
+            // the column type or null
+            node.nullable = true;
+            continue;
+        }
+        if (keyword == "properties" && value.IsObject() && node.is_group)
+        {
+            for (auto &prop : value.GetObject())
+            {
+                int child = findChild(*nodes, node_id, prop.name.GetString(), prop.name.GetStringLength());
+                if (child < 0 && std::binary_search(node.skipped_children.begin(), node.skipped_children.end(), prop.name.GetString()))
+                {
+                    // the values of columns that are not selected are skipped without validation
+                    continue;
+                }
+                if (child < 0 || !prop.value.IsObject())
+                {
+                    return keyword;
+                }
+                // ~ and / in a key are escaped in a JSON pointer
+                string token;
+                for (const char *c = prop.name.GetString(); c != prop.name.GetString() + prop.name.GetStringLength(); c++)
+                {
+                    token += *c == '~' ? "~0" : *c == '/' ? "~1" : string(1, *c);
+                }
+                string unsupported = compileValidation(prop.value, child, nodes, pointer + "/properties/" + token);
+                if (!unsupported.empty())
+                {
+                    return unsupported;
+                }
+            }
+            continue;
+        }
+        if (keyword == "items" && value.IsObject() && node.is_group)
+        {
+            int list = findChild(*nodes, node_id, "list", 4);
+            int element = list < 0 ? -1 : findChild(*nodes, list, "element", 7);
+            if (element < 0)
+            {
+                return keyword;
+            }
+            string unsupported = compileValidation(value, element, nodes, pointer + "/items");
+            if (!unsupported.empty())
+            {
+                return unsupported;
+            }
+            continue;
+        }
+        if (keyword == "additionalProperties" && value.IsBool() && !value.GetBool() && node.is_group)
+        {
+            // the handler has no column for other keys anyway, they become invalid instead of failing the parser
+            node.no_additional_properties = true;
+            continue;
+        }
+        if (keyword == "required" && value.IsArray() && node.is_group)
+        {
+            node.required_children.assign((node.children.size() + 63) / 64, 0);
+            for (auto &required : value.GetArray())
+            {
+                // keys that are not in the properties are rejected by the handler, so they can never be present
+                int child = required.IsString() ? findChild(*nodes, node_id, required.GetString(), required.GetStringLength()) : -1;
+                if (child < 0 && required.IsString() && std::binary_search(node.skipped_children.begin(), node.skipped_children.end(), required.GetString()))
+                {
+                    continue;
+                }
+                if (child < 0)
+                {
+                    return keyword;
+                }
+                int ordinal = (*nodes)[child].ordinal;
+                node.required_children[ordinal / 64] |= uint64_t(1) << (ordinal % 64);
+            }
+            continue;
+        }
+        bool is_integer = node.kind == value_kind::int32 || node.kind == value_kind::int64;
+        if ((keyword == "minimum" || keyword == "maximum" || keyword == "exclusiveMinimum" || keyword == "exclusiveMaximum") &&
+            (is_integer || node.kind == value_kind::real))
+        {
+            if (value.IsBool())
+            {
+                // draft 4: exclusiveMinimum and exclusiveMaximum change minimum and maximum
+                continue;
+            }
+            if (!value.IsNumber() || keyword == "exclusiveMinimum" || keyword == "exclusiveMaximum")
+            {
+                // the numeric bounds of later drafts are left to the generic validator, the results must not differ
+                return keyword;
+            }
+            bool lower = keyword == "minimum";
+            bool exclusive = false;
+            const char *draft4_flag = lower ? "exclusiveMinimum" : "exclusiveMaximum";
+            if (schema.HasMember(draft4_flag) && schema[draft4_flag].IsBool())
+            {
+                exclusive = schema[draft4_flag].GetBool();
+            }
+            node.check_value = true;
+            if (is_integer)
+            {
+                int64_t bound = integerBound(value, lower, exclusive);
+                if (lower)
+                {
+                    node.int_minimum = std::max(node.int_minimum, bound);
+                }
+                else
+                {
+                    node.int_maximum = std::min(node.int_maximum, bound);
+                }
+            }
+            else if (lower)
+            {
+                node.minimum = value.GetDouble();
+                node.exclusive_minimum = exclusive;
+            }
+            else
+            {
+                node.maximum = value.GetDouble();
+                node.exclusive_maximum = exclusive;
+            }
+            continue;
+        }
+        bool is_string = node.kind == value_kind::string;
+        if ((keyword == "minLength" || keyword == "maxLength") && is_string && value.IsUint64())
+        {
+            node.check_value = true;
+            (keyword == "minLength" ? node.min_length : node.max_length) = value.GetUint64();
+            continue;
+        }
+        if ((keyword == "minItems" || keyword == "maxItems") && node.is_group && value.IsUint64() &&
+            node.children.size() == 1 && (*nodes)[node.children[0]].is_repeated)
+        {
+            node.check_value = true;
+            (keyword == "minItems" ? node.min_length : node.max_length) = value.GetUint64();
+            continue;
+        }
+        if (keyword == "enum" && is_string && value.IsArray())
+        {
+            for (auto &allowed : value.GetArray())
+            {
+                if (!allowed.IsString())
+                {
+                    return keyword;
+                }
+                node.enum_values.emplace_back(allowed.GetString(), allowed.GetStringLength());
+            }
+            node.check_value = true;
+            continue;
+        }
+        return keyword;
+    }
+    return "";
+}
+
+// compile the whole JSON schema for the handler, the root is the array of rows or directly the object of one row
+// returns the first keyword that needs the generic validator, "" if there is none
+static string compileSchemaValidation(Document *schema_doc, vector<schema_node> *nodes)
+{
+    if (schemaType((*schema_doc)["type"]) != "array")
+    {
+        return compileValidation(*schema_doc, 0, nodes, "#");
+    }
+    for (auto &member : schema_doc->GetObject())
+    {
+        string keyword = member.name.GetString();
+        if (keyword != "$schema" && keyword != "$id" && keyword != "$comment" && keyword != "title" &&
+            keyword != "description" && keyword != "type" && keyword != "items")
+        {
+            return keyword;
+        }
+    }
+    return compileValidation((*schema_doc)["items"], 0, nodes, "#/items");
+}
+
+// recursive descent parser of the --where expression, the comparisons are compiled against the leaves they use
+// expression := and {OR and}, and := not {AND not}, not := NOT not | ( expression ) | comparison
+// comparison := path (= | == | != | <> | < | <= | > | >=) literal | path [NOT] IN (literal {, literal}) | path IS [NOT] NULL
+struct where_parser
+{
+    const string &text;
+    vector<schema_node> *nodes;
+    vector<where_node> *where_nodes;
+    size_t pos = 0;
+    string error;
+
+    void skipSpaces()
+    {
+        while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos])))
+        {
+            pos++;
+        }
+    }
+    static bool isWordChar(char c)
+    {
+        return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '$';
+    }
+    // the keyword, case insensitive and not followed by more characters of a word
+    bool keyword(const char *word)
+    {
+        skipSpaces();
+        size_t length = strlen(word);
+        if (text.size() - pos < length || strncasecmp(text.c_str() + pos, word, length) != 0 ||
+            (pos + length < text.size() && isWordChar(text[pos + length])))
+        {
+            return false;
+        }
+        pos += length;
+        return true;
+    }
+    bool symbol(const char *chars)
+    {
+        skipSpaces();
+        if (text.compare(pos, strlen(chars), chars) != 0)
+        {
+            return false;
+        }
+        pos += strlen(chars);
+        return true;
+    }
+    int fail(const string &message)
+    {
+        if (error.empty())
+        {
+            error = message + " at position " + std::to_string(pos);
+        }
+        return -1;
+    }
+    int add(where_node node)
+    {
+        where_nodes->push_back(std::move(node));
+        return where_nodes->size() - 1;
+    }
+
+    int parseOr()
+    {
+        int left = parseAnd();
+        while (left >= 0 && (keyword("OR") || symbol("||")))
+        {
+            int right = parseAnd();
+            if (right < 0)
+            {
+                return -1;
+            }
+            left = add({where_kind::logical_or, -1, 0, {}, {left, right}});
+        }
+        return left;
+    }
+    int parseAnd()
+    {
+        int left = parseNot();
+        while (left >= 0 && (keyword("AND") || symbol("&&")))
+        {
+            int right = parseNot();
+            if (right < 0)
+            {
+                return -1;
+            }
+            left = add({where_kind::logical_and, -1, 0, {}, {left, right}});
+        }
+        return left;
+    }
+    int parseNot()
+    {
+        if (keyword("NOT") || symbol("!"))
+        {
+            int operand = parseNot();
+            return operand < 0 ? -1 : add({where_kind::logical_not, -1, 0, {}, {operand}});
+        }
+        if (symbol("("))
+        {
+            int inner = parseOr();
+            if (inner >= 0 && !symbol(")"))
+            {
+                return fail("Missing ')'");
+            }
+            return inner;
+        }
+        return parseComparison();
+    }
+    int parseComparison()
+    {
+        skipSpaces();
+        string path;
+        if (pos < text.size() && text[pos] == '`')
+        {
+            // paths with other characters are quoted in backticks
+            size_t end = text.find('`', pos + 1);
+            if (end == string::npos)
+            {
+                return fail("Missing '`'");
+            }
+            path = text.substr(pos + 1, end - pos - 1);
+            pos = end + 1;
+        }
+        else
+        {
+            size_t begin = pos;
+            while (pos < text.size() && isWordChar(text[pos]))
+            {
+                pos++;
+            }
+            path = text.substr(begin, pos - begin);
+        }
+        if (path.empty())
+        {
+            return fail("Missing column");
+        }
+        auto leaf = std::find_if(nodes->begin(), nodes->end(), [&](const schema_node &node)
+                                 { return node.leaf_index >= 0 && node.path == path; });
+        if (leaf == nodes->end())
+        {
+            return fail("Column '" + path + "' is not a leaf of the schema");
+        }
+        // a leaf in a list has many values in one row
+        for (int ancestor = leaf->parent; ancestor > 0; ancestor = (*nodes)[ancestor].parent)
+        {
+            if ((*nodes)[ancestor].is_repeated)
+            {
+                return fail("Column '" + path + "' is in a list");
+            }
+        }
+        where_node comparison;
+        comparison.leaf = leaf - nodes->begin();
+        if (keyword("IS"))
+        {
+            comparison.kind = keyword("NOT") ? where_kind::is_not_null : where_kind::is_null;
+            if (!keyword("NULL"))
+            {
+                return fail("Missing NULL");
+            }
+            return addComparison(std::move(comparison));
+        }
+        bool negated = keyword("NOT");
+        if (keyword("IN"))
+        {
+            comparison.kind = where_kind::in_list;
+            comparison.accepted = 2;
+            if (!symbol("("))
+            {
+                return fail("Missing '('");
+            }
+            do
+            {
+                comparison.literals.emplace_back();
+                if (!parseLiteral(*leaf, &comparison.literals.back()))
+                {
+                    return -1;
+                }
+            } while (symbol(","));
+            if (!symbol(")"))
+            {
+                return fail("Missing ')'");
+            }
+            int id = addComparison(std::move(comparison));
+            return negated ? add({where_kind::logical_not, -1, 0, {}, {id}}) : id;
+        }
+        if (negated)
+        {
+            return fail("Missing IN");
+        }
+        // the operators with two characters first
+        static const pair<const char *, uint8_t> operators[] = {{"==", 2}, {"!=", 5}, {"<>", 5}, {"<=", 3}, {">=", 6}, {"=", 2}, {"<", 1}, {">", 4}};
+        for (const auto &op : operators)
+        {
+            if (symbol(op.first))
+            {
+                comparison.accepted = op.second;
+                comparison.literals.emplace_back();
+                if (!parseLiteral(*leaf, &comparison.literals.back()))
+                {
+                    return -1;
+                }
+                return addComparison(std::move(comparison));
+            }
+        }
+        return fail("Missing operator");
+    }
+    int addComparison(where_node comparison)
+    {
+        int leaf = comparison.leaf;
+        int id = add(std::move(comparison));
+        (*nodes)[leaf].where_comparisons.push_back(id);
+        return id;
+    }
+    // a literal in the representation of the leaf it is compared with
+    bool parseLiteral(const schema_node &leaf, where_literal *literal)
+    {
+        skipSpaces();
+        if (leaf.kind == value_kind::none)
+        {
+            fail("Column '" + leaf.path + "' can only be compared with IS NULL");
+            return false;
+        }
+        if (leaf.kind == value_kind::boolean)
+        {
+            literal->is_integer = true;
+            literal->integer = keyword("true");
+            if (literal->integer == 0 && !keyword("false"))
+            {
+                fail("Missing true or false for column '" + leaf.path + "'");
+                return false;
+            }
+            return true;
+        }
+        if (leaf.kind == value_kind::int32 || leaf.kind == value_kind::int64 || leaf.kind == value_kind::real)
+        {
+            const char *begin = text.c_str() + pos;
+            char *end;
+            literal->real = strtod(begin, &end);
+            if (end == begin)
+            {
+                fail("Missing number for column '" + leaf.path + "'");
+                return false;
+            }
+            string number(begin, end - begin);
+            pos += end - begin;
+            if (number.find_first_not_of("+-0123456789") == string::npos)
+            {
+                errno = 0;
+                literal->integer = strtoll(number.c_str(), nullptr, 10);
+                literal->is_integer = errno == 0;
+            }
+            return true;
+        }
+        if (pos == text.size() || (text[pos] != '\'' && text[pos] != '"'))
+        {
+            fail("Missing string for column '" + leaf.path + "'");
+            return false;
+        }
+        // a backslash escapes the quote and itself
+        char quote = text[pos++];
+        while (pos < text.size() && text[pos] != quote)
+        {
+            if (text[pos] == '\\' && pos + 1 < text.size())
+            {
+                pos++;
+            }
+            literal->text.push_back(text[pos++]);
+        }
+        if (pos == text.size())
+        {
+            fail("Missing end of string");
+            return false;
+        }
+        pos++;
+        const string &value = literal->text;
+        literal->is_integer = true;
+        bool parsed = true;
+        if (leaf.kind == value_kind::date)
+        {
+            int32_t days;
+            parsed = parseDate(value.c_str(), value.size(), &days);
+            literal->integer = days;
+        }
+        else if (leaf.kind == value_kind::timestamp)
+        {
+            parsed = parseTimestamp(value.c_str(), value.size(), leaf.units_per_second, &literal->integer);
+        }
+        else if (leaf.kind == value_kind::time)
+        {
+            parsed = parseTime(value.c_str(), value.size(), leaf.units_per_second, &literal->integer);
+            int64_t day = 24 * 60 * 60 * leaf.units_per_second;
+            literal->integer = (literal->integer % day + day) % day;
+        }
+        else
+        {
+            literal->is_integer = false;
+        }
+        if (!parsed)
+        {
+            fail("'" + value + "' is no valid value for column '" + leaf.path + "'");
+            return false;
+        }
+        return true;
+    }
+};
+
+// compile the --where expression into the settings and the leaves it compares
+// returns why it can not be compiled, "" on success
+static string compileWhere(const string &expression, conversion_settings *settings)
+{
+    where_parser parser{expression, &settings->schema_nodes, &settings->where_nodes};
+    settings->where_root = parser.parseOr();
+    parser.skipSpaces();
+    if (settings->where_root >= 0 && parser.pos < expression.size())
+    {
+        parser.fail("Unexpected '" + expression.substr(parser.pos, 10) + "'");
+    }
+    if (!parser.error.empty())
+    {
+        settings->where_root = -1;
+    }
+    return parser.error;
+}
+
+// reader of the input, it also reports NDJSON rows that share a line
+struct row_reader : public Reader
+{
+    // the rest of the line behind a row is not empty, the same error as behind the root of a JSON document
+    void failSharedLine(size_t offset)
+    {
+        SetParseError(kParseErrorDocumentRootNotSingular, offset);
+    }
+};
+
+// parse one JSON document, or for NDJSON one document per line until the end of the input
+template <unsigned parseFlags, typename InputStream, typename Handler>
+bool parseDocuments(row_reader &reader, InputStream &stream, Handler &handler, bool ndjson)
+{
+    if (!ndjson)
+    {
+        return reader.Parse<parseFlags>(stream, handler);
+    }
+    SkipWhitespace(stream);
+    while (stream.Peek() != '\0')
+    {
+        if (!reader.Parse<parseFlags | kParseStopWhenDoneFlag>(stream, handler))
+        {
+            return false;
+        }
+        // the next row has to start on a new line
+        while (stream.Peek() == ' ' || stream.Peek() == '\t' || stream.Peek() == '\r')
+        {
+            stream.Take();
+        }
+        if (stream.Peek() != '\n' && stream.Peek() != '\0')
+        {
+            reader.failSharedLine(stream.Tell());
+            return false;
+        }
+        SkipWhitespace(stream);
+    }
+    return true;
+}
+
+// parse the whole input stream into the handler, validating it against the schema on the way
+template <unsigned parseFlags, typename InputStream>
+void parseInput(row_reader &reader, InputStream &stream, MyHandler &handler, SchemaDocument *json_schema, bool novalidate, bool ndjson)
+{
+    if (novalidate || json_schema == nullptr)
+    {
+        // without the generic validator the handler checks the compiled schema itself, unless validation is off
+        // it sees the events of the stream directly, so the values of columns that are not selected need not be parsed
+        if constexpr (std::is_same_v<InputStream, skipping_stream>)
+        {
+            handler.skip_stream = &stream;
+        }
+        if (!parseDocuments<parseFlags>(reader, stream, handler, ndjson) && handler.invalid_keyword != nullptr)
+        {
+            auto now = std::chrono::system_clock::now();
+            ostringstream oss;
+            const schema_node &node = handler.nodes[handler.invalid_node];
+            oss << now << ": Invalid schema: " << node.schema_pointer << "\n";
+            oss << now << ": Invalid keyword: " << handler.invalid_keyword << "\n";
+            oss << now << ": Invalid column: " << node.path << "\n";
+            printLog(oss.str());
+        }
+        handler.skip_stream = nullptr;
+    }
+    else
+    {
+        GenericSchemaValidator<SchemaDocument, MyHandler> validator((*json_schema), handler);
+        // see: https://github.com/pah/rapidjson/blob/master/example/schemavalidator/schemavalidator.cpp
+        // https://rapidjson.org/md_doc_schema.html
+        if (!parseDocuments<parseFlags>(reader, stream, validator, ndjson) && reader.GetParseErrorCode() == kParseErrorTermination)
+        {
+            // Not a valid JSON
+            // When reader.GetParseResult().Code() == kParseErrorTermination,
+            // it may be terminated by:
+            // (1) the validator found that the JSON is invalid according to schema; or
+            // (2) the input stream has I/O error.
+
+            // Check the validation result
+            if (!validator.IsValid())
+            {
+                // Input JSON is invalid according to the schema
+                StringBuffer sb;
+                validator.GetInvalidSchemaPointer().StringifyUriFragment(sb);
+                auto now = std::chrono::system_clock::now();
+                ostringstream oss;
+                oss << now << ": Invalid schema: " << sb.GetString() << "\n";
+                oss << now << ": Invalid keyword: " << validator.GetInvalidSchemaKeyword() << "\n";
+                sb.Clear();
+                validator.GetInvalidDocumentPointer().StringifyUriFragment(sb);
+                oss << now << ": Invalid document: " << sb.GetString() << "\n";
+                printLog(oss.str());
+            }
+        }
+    }
+}
+
+// NDJSON rows that failed to convert with --dead-letter, one NDJSON record per row
+struct dead_letters
+{
+    string records;
+    uint64_t rows = 0;
+    // the records are written through when set, a worker keeps them until its chunk is written
+    ofstream *file = nullptr;
+
+    static constexpr size_t write_size = 1024 * 1024;
+};
+
+// add the record of a row that failed: the input offset of the error, why it failed and the text of the row
+void addDeadLetter(dead_letters *letters, size_t offset, const char *error, const char *keyword, const string &path, const char *schema_pointer, const char *row, size_t length)
+{
+    StringBuffer record;
+    Writer<StringBuffer> writer(record);
+    writer.StartObject();
+    writer.Key("offset");
+    writer.Uint64(offset);
+    writer.Key("error");
+    writer.String(error);
+    if (keyword != nullptr && keyword[0] != '\0')
+    {
+        writer.Key("keyword");
+        writer.String(keyword);
+    }
+    if (schema_pointer != nullptr)
+    {
+        writer.Key("schema");
+        writer.String(schema_pointer);
+    }
+    writer.Key("path");
+    writer.String(path.c_str(), path.size());
+    writer.Key("row");
+    writer.String(row, length);
+    writer.EndObject();
+    letters->records.append(record.GetString(), record.GetSize());
+    letters->records.push_back('\n');
+    letters->rows++;
+    if (letters->file != nullptr && letters->records.size() >= dead_letters::write_size)
+    {
+        letters->file->write(letters->records.data(), letters->records.size());
+        letters->records.clear();
+    }
+}
+
+// parse NDJSON rows in memory line by line for --dead-letter
+// a row that fails is taken out of the batch again, the rest of its line goes to the dead letters and the next line is parsed
+// false if the conversion has to stop anyway, with the error and its offset in the input
+bool parseLines(row_reader &reader, const char *input, size_t length, size_t input_offset, MyHandler &handler, SchemaDocument *json_schema, bool novalidate,
+                dead_letters *letters, ParseErrorCode *error, size_t *error_offset)
+{
+    std::unique_ptr<GenericSchemaValidator<SchemaDocument, MyHandler>> validator;
+    if (!novalidate && json_schema != nullptr)
+    {
+        validator.reset(new GenericSchemaValidator<SchemaDocument, MyHandler>(*json_schema, handler));
+    }
+    size_t begin = 0;
+    while (begin < length)
+    {
+        const char *newline = static_cast<const char *>(memchr(input + begin, '\n', length - begin));
+        size_t end = newline ? newline - input : length;
+        skipping_stream line(input + begin, end - begin);
+        handler.skip_stream = validator ? nullptr : &line;
+        SkipWhitespace(line);
+        while (line.Peek() != '\0')
+        {
+            size_t row_begin = line.Tell();
+            bool parsed = validator ? !reader.Parse<kParseStopWhenDoneFlag>(line, *validator).IsError()
+                                    : !reader.Parse<kParseStopWhenDoneFlag>(line, handler).IsError();
+            if (!parsed)
+            {
+                // where the row failed, before its state is reset
+                const string &path = handler.nodes[handler.ctx->current_node].path;
+                const char *keyword = handler.invalid_keyword;
+                StringBuffer schema_pointer;
+                bool invalid_schema = validator && !validator->IsValid();
+                if (invalid_schema)
+                {
+                    keyword = validator->GetInvalidSchemaKeyword();
+                    validator->GetInvalidSchemaPointer().StringifyUriFragment(schema_pointer);
+                }
+                // the subschema of the keyword checked inline by the handler
+                const char *pointer = invalid_schema ? schema_pointer.GetString()
+                                      : keyword != nullptr ? handler.nodes[handler.invalid_node].schema_pointer.c_str()
+                                                           : nullptr;
+                size_t offset = begin + reader.GetErrorOffset();
+                if (!handler.discardRow())
+                {
+                    *error = reader.GetParseErrorCode();
+                    *error_offset = offset;
+                    handler.skip_stream = nullptr;
+                    return false;
+                }
+                size_t row_end = end;
+                if (row_end > begin + row_begin && input[row_end - 1] == '\r')
+                {
+                    row_end--;
+                }
+                addDeadLetter(letters, input_offset + offset, GetParseError_En(reader.GetParseErrorCode()), keyword, path,
+                              pointer, input + begin + row_begin, row_end - begin - row_begin);
+                if (validator)
+                {
+                    validator->Reset();
+                }
+                break;
+            }
+            SkipWhitespace(line);
+            if (line.Peek() != '\0')
+            {
+                // the rest of the line behind a row is no row of its own
+                size_t row_begin = line.Tell();
+                size_t row_end = end;
+                if (row_end > begin + row_begin && input[row_end - 1] == '\r')
+                {
+                    row_end--;
+                }
+                addDeadLetter(letters, input_offset + begin + row_begin, GetParseError_En(kParseErrorDocumentRootNotSingular), nullptr, "",
+                              nullptr, input + begin + row_begin, row_end - begin - row_begin);
+                break;
+            }
+        }
+        begin = end + 1;
+    }
+    handler.skip_stream = nullptr;
+    return true;
+}
+
+// lines of an NDJSON input shredded by one worker thread
+struct input_chunk
+{
+    char *begin;
+    size_t length;
+    // offset of the chunk in the input
+    size_t input_offset;
+    // the batches of the chunk, the writer takes them while the chunk is still shredded once it is the next one to write
+    batch_queue *batches = nullptr;
+    // rows of the chunk that failed with --dead-letter
+    dead_letters letters;
+    ParseErrorCode error = kParseErrorNone;
+    size_t error_offset = 0;
+};
+
+// shred all rows of the chunk into its batch queue, runs on a worker thread
+void shredChunk(input_chunk *chunk, const conversion_settings *settings)
+{
+    conversion_context context(settings);
+    context.queue = chunk->batches;
+
+    MyHandler handler(&context);
+    row_reader reader;
+    if (settings->dead_letter)
+    {
+        parseLines(reader, chunk->begin, chunk->length, chunk->input_offset, handler, settings->json_schema, settings->novalidate,
+                   &chunk->letters, &chunk->error, &chunk->error_offset);
+    }
+    else
+    {
+        if (settings->insitu)
+        {
+            // the chunk is null terminated in place of the newline behind it
+            rapidjson::InsituStringStream insituStream(chunk->begin);
+            parseInput<kParseInsituFlag>(reader, insituStream, handler, settings->json_schema, settings->novalidate, true);
+        }
+        else
+        {
+            skipping_stream chunkStream(chunk->begin, chunk->length);
+            parseInput<kParseDefaultFlags>(reader, chunkStream, handler, settings->json_schema, settings->novalidate, true);
+        }
+
+        if (reader.HasParseError())
+        {
+            chunk->error = reader.GetParseErrorCode();
+            chunk->error_offset = reader.GetErrorOffset();
+        }
+    }
+    bool failed = chunk->error != kParseErrorNone;
+    // rows of the last batch, after a parse error the unfinished row is left out by the writer
+    if (context.batch_rows > 0 && !context.write_failed)
+    {
+        chargeMemory(settings, &context.charged_batch_bytes, batchMemory(context.parquet_data));
+        finishBatch(&context, failed);
+    }
+    // the bytes of an unfinished row that failed to parse
+    chargeMemory(settings, &context.charged_batch_bytes, 0);
+    {
+        std::lock_guard<std::mutex> lock(chunk->batches->mutex);
+        chunk->batches->closed = true;
+    }
+    chunk->batches->changed.notify_all();
+}
+
+// convert NDJSON input with worker threads, each shredding chunks of whole lines
+// the calling thread writes the batches of the chunks in input order into the file writer of the context
+void parseChunks(conversion_context *ctx, char *input, size_t length, dead_letters *letters, ParseErrorCode *error, size_t *error_offset)
+{
+    const conversion_settings *settings = ctx->settings;
+    vector<input_chunk> chunks;
+    size_t begin = 0;
+    while (begin < length)
+    {
+        size_t end = std::min<uint64_t>(length, begin + std::max<uint64_t>(1, settings->chunk_size));
+        // extend the chunk to the end of its last line
+        const char *newline = end < length ? static_cast<const char *>(memchr(input + end, '\n', length - end)) : nullptr;
+        end = newline ? newline - input : length;
+        chunks.push_back({input + begin, end - begin, begin});
+        if (settings->insitu && end < length)
+        {
+            input[end] = '\0';
+        }
+        begin = end + 1;
+    }
+    // the batches of a chunk are only bounded by the memory budget, a worker does not wait for the chunks before its own
+    vector<batch_queue> queues(chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        queues[i].capacity = SIZE_MAX;
+        chunks[i].batches = &queues[i];
+    }
+
+    std::mutex chunk_mutex;
+    std::condition_variable chunk_done;
+    size_t next_chunk = 0;
+    size_t written_chunks = 0;
+    bool stop = false;
+    // shredded chunks are kept in memory until they are written, limit how far the workers run ahead
+    size_t max_pending_chunks = 2 * settings->threads;
+
+    vector<std::thread> workers;
+    for (int t = 0; t < settings->threads; t++)
+    {
+        workers.emplace_back([&]()
+                             {
+            while (true)
+            {
+                size_t index;
+                {
+                    std::unique_lock<std::mutex> lock(chunk_mutex);
+                    chunk_done.wait(lock, [&]()
+                                    { return stop || next_chunk >= chunks.size() || next_chunk < written_chunks + max_pending_chunks; });
+                    if (stop || next_chunk >= chunks.size())
+                    {
+                        return;
+                    }
+                    index = next_chunk++;
+                }
+                shredChunk(&chunks[index], settings);
+            } });
+    }
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        input_chunk &chunk = chunks[i];
+        batch_queue &queue = queues[i];
+        // the worker of the chunk may run on while the memory budget is used up, the writer takes its batches right away
+        queue.awaited = true;
+        if (settings->memory != nullptr)
+        {
+            settings->memory->notify();
+        }
+        encodeBatches(ctx, &queue);
+        bool written = !queue.failed;
+        {
+            // after an error the worker stops at its next batch, the chunk is complete when it closes the queue
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.changed.wait(lock, [&]()
+                               { return queue.closed; });
+            // the batches behind the failed one release their bytes
+            for (pending_batch &batch : queue.full)
+            {
+                dropBatch(settings, &batch);
+            }
+            queue.full.clear();
+            releaseFreeBatches(settings, &queue);
+        }
+        // the dead letters of the chunks are written in input order too
+        if (letters->file != nullptr && chunk.letters.rows > 0)
+        {
+            letters->file->write(chunk.letters.records.data(), chunk.letters.records.size());
+            letters->rows += chunk.letters.rows;
+            chunk.letters.records = string();
+        }
+
+        if (chunk.error != kParseErrorNone)
+        {
+            *error = chunk.error;
+            *error_offset = (chunk.begin - input) + chunk.error_offset;
+        }
+        else if (!written)
+        {
+            *error = kParseErrorTermination;
+            *error_offset = chunk.begin - input;
+        }
+        {
+            std::lock_guard<std::mutex> lock(chunk_mutex);
+            written_chunks++;
+            stop = *error != kParseErrorNone;
+        }
+        chunk_done.notify_all();
+        if (*error != kParseErrorNone)
+        {
+            // the workers of the following chunks stop at their next batch
+            for (size_t j = i + 1; j < chunks.size(); j++)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(queues[j].mutex);
+                    queues[j].failed = true;
+                }
+                queues[j].changed.notify_all();
+            }
+            if (settings->memory != nullptr)
+            {
+                settings->memory->notify();
+            }
+            break;
+        }
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    // after an error the chunks that were not written release the bytes of their batches
+    for (batch_queue &queue : queues)
+    {
+        for (pending_batch &batch : queue.full)
+        {
+            dropBatch(settings, &batch);
+        }
+    }
+    chargeMemory(settings, &ctx->charged_batch_bytes, 0);
+    ctx->batch_rows = 0;
+}
+
+// output stream that hands the written bytes to a thread owning the file, encoding does not wait for the disk
+struct background_output_stream : public arrow::io::OutputStream
+{
+    std::shared_ptr<arrow::io::OutputStream> sink;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable changed;
+    // bytes written since the last hand over
+    vector<uint8_t> current;
+    std::deque<vector<uint8_t>> buffers;
+    size_t pending_bytes = 0;
+    // the pending bytes are charged to the memory budget if there is one
+    memory_budget *memory;
+    bool writing = false;
+    bool stop = false;
+    arrow::Status write_status;
+    int64_t position = 0;
+    bool is_closed = false;
+
+    static constexpr size_t buffer_size = 1024 * 1024;
+    static constexpr size_t max_pending_bytes = 16 * 1024 * 1024;
+
+    background_output_stream(std::shared_ptr<arrow::io::OutputStream> output, memory_budget *budget) : sink(std::move(output)), memory(budget)
+    {
+        writer = std::thread([this]()
+                             { writeBuffers(); });
+    }
+    ~background_output_stream() override
+    {
+        if (!is_closed)
+        {
+            (void)Close();
+        }
+    }
+
+    arrow::Status Write(const void *data, int64_t nbytes) override
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        current.insert(current.end(), bytes, bytes + nbytes);
+        position += nbytes;
+        if (current.size() >= buffer_size)
+        {
+            return handOver();
+        }
+        return arrow::Status::OK();
+    }
+    arrow::Status Flush() override
+    {
+        ARROW_RETURN_NOT_OK(handOver());
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]()
+                         { return (buffers.empty() && !writing) || !write_status.ok(); });
+            ARROW_RETURN_NOT_OK(write_status);
+        }
+        // the writer thread is idle until the next hand over
+        return sink->Flush();
+    }
+    arrow::Status Close() override
+    {
+        if (is_closed)
+        {
+            return arrow::Status::OK();
+        }
+        arrow::Status handed_over = handOver();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        writer.join();
+        is_closed = true;
+        ARROW_RETURN_NOT_OK(handed_over);
+        ARROW_RETURN_NOT_OK(write_status);
+        return sink->Close();
+    }
+    arrow::Result<int64_t> Tell() const override
+    {
+        return position;
+    }
+    bool closed() const override
+    {
+        return is_closed;
+    }
+
+    // queue the collected bytes for the writer thread, waits while too many bytes are pending
+    arrow::Status handOver()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]()
+                         { return pending_bytes < max_pending_bytes || !write_status.ok(); });
+            ARROW_RETURN_NOT_OK(write_status);
+            if (current.empty())
+            {
+                return arrow::Status::OK();
+            }
+            pending_bytes += current.size();
+            if (memory != nullptr)
+            {
+                memory->used += current.size();
+                memory->handOn(current.size());
+            }
+            buffers.push_back(std::move(current));
+            current = vector<uint8_t>();
+        }
+        changed.notify_all();
+        return arrow::Status::OK();
+    }
+    // write the queued buffers in order until the stream is closed
+    void writeBuffers()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            changed.wait(lock, [&]()
+                         { return stop || !buffers.empty(); });
+            if (buffers.empty())
+            {
+                return;
+            }
+            vector<uint8_t> buffer = std::move(buffers.front());
+            buffers.pop_front();
+            writing = true;
+            lock.unlock();
+            arrow::Status written = sink->Write(buffer.data(), buffer.size());
+            lock.lock();
+            writing = false;
+            pending_bytes -= buffer.size();
+            if (memory != nullptr)
+            {
+                memory->used -= buffer.size();
+                memory->arrived(buffer.size());
+            }
+            if (!written.ok())
+            {
+                write_status = written;
+                for (const vector<uint8_t> &unwritten : buffers)
+                {
+                    if (memory != nullptr)
+                    {
+                        memory->used -= unwritten.size();
+                        memory->arrived(unwritten.size());
+                    }
+                }
+                buffers.clear();
+                changed.notify_all();
+                return;
+            }
+            changed.notify_all();
+        }
+    }
+};
+
+// convert one JSON file, any number of conversions can run at the same time with the same settings
+int parseJSONToParquet(string path, string parquet_name, const conversion_settings *settings)
+{
+    conversion_context context(settings);
+    // the column threads are started once, not for every batch
+    std::unique_ptr<worker_pool> pool;
+    if (settings->column_threads > 1 && settings->num_columns > 1)
+    {
+        pool.reset(new worker_pool(std::min(settings->column_threads, settings->num_columns)));
+        context.pool = pool.get();
+    }
+    bool insitu = settings->insitu;
+    bool ndjson = settings->ndjson;
+    bool novalidate = settings->novalidate;
+    int buffersize = settings->buffersize;
+
+    // NDJSON can be split at line ends and shredded by several threads
+    bool parallel = ndjson && settings->threads > 1;
+    // the lines of rows that fail are copied from the input, so it has to be in memory
+    bool in_memory = parallel || settings->dead_letter;
+
+    FILE *file = fopen(path.c_str(), "r");
+
+    if (!file)
+    {
+        auto now = std::chrono::system_clock::now();
+        ostringstream oss;
+        oss << now << ": CANNOT open file: '" << path << "'" << "\n";
+        printLog(oss.str());
+        return -1;
+    }
+
+    // map regular files into memory, pipes and other streams are read through the buffer
+    // with --columns and --where the skipped values are only passed over without parsing in a mapped input
+    bool use_mmap = false;
+    char *mapped_input = nullptr;
+    size_t mapped_size = 0;
+    size_t mapping_size = 0;
+    struct stat file_stat;
+    if ((settings->mmap_input || in_memory || settings->projection || settings->where_root >= 0) && fstat(fileno(file), &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+    {
+        mapped_size = file_stat.st_size;
+        void *mapping = MAP_FAILED;
+        if (insitu)
+        {
+            // in situ parsing writes into the input and needs a null terminator behind it
+            // reserve zeroed memory one byte longer than the file and map the file privately over its start
+            mapping_size = mapped_size + 1;
+            void *reserved = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (reserved != MAP_FAILED)
+            {
+                mapping = mmap(reserved, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(file), 0);
+                if (mapping == MAP_FAILED)
+                {
+                    munmap(reserved, mapping_size);
+                }
+            }
+        }
+        else
+        {
+            mapping_size = mapped_size;
+            mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        }
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, mapped_size, MADV_SEQUENTIAL);
+            mapped_input = static_cast<char *>(mapping);
+            use_mmap = true;
+        }
+    }
+    // without a mapping in situ, parallel and dead-letter parsing read the whole input into one buffer
+    vector<char> input_buffer;
+    if ((insitu || in_memory) && !use_mmap)
+    {
+        size_t read_bytes = 0;
+        input_buffer.resize(std::max(buffersize, 1));
+        while (size_t n = fread(input_buffer.data() + read_bytes, 1, input_buffer.size() - read_bytes, file))
+        {
+            read_bytes += n;
+            if (read_bytes == input_buffer.size())
+            {
+                input_buffer.resize(read_bytes * 2);
+            }
+        }
+        input_buffer.resize(read_bytes);
+        input_buffer.push_back('\0');
+    }
+    // with the pipeline the rows are shredded into their own context and its batches are encoded on a separate thread
+    bool pipeline = settings->pipeline && !parallel;
+    std::unique_ptr<conversion_context> shred_context;
+    std::unique_ptr<batch_queue> queue;
+    if (pipeline)
+    {
+        shred_context.reset(new conversion_context(settings));
+        queue.reset(new batch_queue());
+        shred_context->queue = queue.get();
+    }
+    MyHandler handler(pipeline ? shred_context.get() : &context);
+    row_reader handlerReader;
+
+    // Setup Parquet writer
+    // Create a local file output stream instance.
+    std::shared_ptr<arrow::io::FileOutputStream> out_file;
+
+    PARQUET_ASSIGN_OR_THROW(out_file, arrow::io::FileOutputStream::Open(parquet_name));
+    std::shared_ptr<arrow::io::OutputStream> sink = out_file;
+    if (settings->pipeline)
+    {
+        // the file is written by its own thread
+        sink = std::make_shared<background_output_stream>(out_file, settings->memory);
+    }
+
+    // Create a ParquetFileWriter instance
+    context.file_writer = parquet::ParquetFileWriter::Open(sink, settings->parquet_schema, settings->writer_props);
+    // Append a RowGroup
+    context.rg_writer = context.file_writer->AppendBufferedRowGroup();
+    std::thread encoder;
+    if (pipeline)
+    {
+        encoder = std::thread(encodeBatches, &context, queue.get());
+    }
+    // rows that fail are written next to the output instead of stopping the conversion
+    dead_letters letters;
+    ofstream dead_letter_file;
+    string dead_letter_name = parquet_name;
+    if (dead_letter_name.size() > 8 && dead_letter_name.compare(dead_letter_name.size() - 8, 8, ".parquet") == 0)
+    {
+        dead_letter_name.resize(dead_letter_name.size() - 8);
+    }
+    dead_letter_name += ".dead.ndjson";
+    if (settings->dead_letter)
+    {
+        dead_letter_file.open(dead_letter_name, ios::binary | ios::trunc);
+        letters.file = &dead_letter_file;
+    }
+
+    auto now = std::chrono::system_clock::now();
+    auto start = now;
+    stringstream oss;
+    oss << now << ": START Parsing \"" << path << "\"" << "\n";
+    printLog(oss.str());
+    ParseErrorCode parse_error = kParseErrorNone;
+    size_t error_offset = 0;
+    if (parallel)
+    {
+        parseChunks(&context, use_mmap ? mapped_input : input_buffer.data(), use_mmap ? mapped_size : input_buffer.size() - 1, &letters, &parse_error, &error_offset);
+    }
+    else if (settings->dead_letter)
+    {
+        parseLines(handlerReader, use_mmap ? mapped_input : input_buffer.data(), use_mmap ? mapped_size : input_buffer.size() - 1, 0, handler,
+                   settings->json_schema, novalidate, &letters, &parse_error, &error_offset);
+    }
+    else if (insitu)
+    {
+        rapidjson::InsituStringStream insituStream(use_mmap ? mapped_input : input_buffer.data());
+        parseInput<kParseInsituFlag>(handlerReader, insituStream, handler, settings->json_schema, novalidate, ndjson);
+    }
+    else if (use_mmap)
+    {
+        skipping_stream mappedStream(mapped_input, mapped_size);
+        parseInput<kParseDefaultFlags>(handlerReader, mappedStream, handler, settings->json_schema, novalidate, ndjson);
+    }
+    else
+    {
+        // the read buffer lives on the heap, a large --buffer would overflow the stack
+        std::unique_ptr<char[]> readBuffer(new char[buffersize]);
+        rapidjson::FileReadStream readStream(file, readBuffer.get(), buffersize);
+        parseInput<kParseDefaultFlags>(handlerReader, readStream, handler, settings->json_schema, novalidate, ndjson);
+    }
+    // the reader keeps the error of the last row written to the dead letters, parseLines reports the errors itself
+    if (!settings->dead_letter && handlerReader.HasParseError())
+    {
+        parse_error = handlerReader.GetParseErrorCode();
+        error_offset = handlerReader.GetErrorOffset();
+    }
+
+    fclose(file);
+    // write the rows of the last batch, after a parse error only the finished rows
+    if (pipeline)
+    {
+        finishBatch(shred_context.get(), parse_error != kParseErrorNone);
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->closed = true;
+        }
+        queue->changed.notify_all();
+        encoder.join();
+        // after a writing error the batches that were not written release their bytes
+        for (pending_batch &batch : queue->full)
+        {
+            dropBatch(settings, &batch);
+        }
+        releaseFreeBatches(settings, queue.get());
+        chargeMemory(settings, &shred_context->charged_batch_bytes, 0);
+        // a row that failed after parts of it were written is completed
+        flushBatch(&context, parse_error != kParseErrorNone);
+    }
+    else
+    {
+        flushBatch(&context, parse_error != kParseErrorNone);
+    }
+    context.file_writer->Close();
+    // the file writer leaves the sink open, a failed write of its last bytes must not go unnoticed
+    PARQUET_THROW_NOT_OK(sink->Close());
+    chargeMemory(settings, &context.charged_batch_bytes, 0);
+    chargeMemory(settings, &context.charged_row_group_bytes, 0);
+    // strings parsed in situ point into the input, it is released after the last batch
+    if (use_mmap)
+    {
+        munmap(mapped_input, mapping_size);
+    }
+    if (settings->dead_letter)
+    {
+        dead_letter_file.write(letters.records.data(), letters.records.size());
+        dead_letter_file.close();
+        if (letters.rows == 0)
+        {
+            std::remove(dead_letter_name.c_str());
+        }
+        else
+        {
+            now = std::chrono::system_clock::now();
+            oss.str(std::string());
+            oss << now << ": QUARANTINED " << letters.rows << " rows of \"" << path << "\" in \"" << dead_letter_name << "\"" << "\n";
+            printLog(oss.str());
+        }
+    }
+
+    if (parse_error != kParseErrorNone)
+    {
+        now = std::chrono::system_clock::now();
+        oss.str(std::string());
+        oss << now << ": Error at '" << error_offset << "': " << GetParseError_En(parse_error) << "\n";
+        printLog(oss.str());
+        if (context.broken_row_written)
+        {
+            // parts of the failed row are in the file already and their levels do not fit together
+            std::remove(parquet_name.c_str());
+            now = std::chrono::system_clock::now();
+            oss.str(std::string());
+            oss << now << ": REMOVED \"" << parquet_name << "\", the row that failed was written partly with --row-flush-size" << "\n";
+            printLog(oss.str());
+        }
+        return -1;
+    }
+    now = std::chrono::system_clock::now();
+    auto finish = now;
+    oss.str(std::string());
+    oss << now << ": FINISH Parsing" << "\n";
+    printLog(oss.str());
+    if (settings->logs || settings->print_duration)
+    {
+        auto duration = chrono::duration_cast<chrono::milliseconds>(finish - start);
+        now = std::chrono::system_clock::now();
+        oss.str(std::string());
+        oss << now << ": Duration: " << duration << "\n";
+        printLog(oss.str());
+    }
+    return 0;
+}
+
+// --infer: what the values at one place of the rows look like, the JSON schema is derived from it
+struct inferred_type
+{
+    // kinds of the values, one bit each
+    static constexpr uint32_t null_kind = 1;
+    static constexpr uint32_t boolean_kind = 2;
+    static constexpr uint32_t integer_kind = 4;
+    static constexpr uint32_t number_kind = 8;
+    static constexpr uint32_t string_kind = 16;
+    static constexpr uint32_t array_kind = 32;
+    static constexpr uint32_t object_kind = 64;
+    uint32_t kinds = 0;
+    // number of values, null included
+    uint64_t count = 0;
+    // range of the integers, above_int64 for integers that only fit UINT64
+    int64_t minimum = INT64_MAX;
+    int64_t maximum = INT64_MIN;
+    bool above_int64 = false;
+    // every string is a date, date-time or time
+    bool dates = true;
+    bool date_times = true;
+    bool times = true;
+    // number of objects, a property in all of them that is never null is required
+    uint64_t objects = 0;
+    // properties in the order they first appeared
+    vector<string> names;
+    vector<inferred_type> properties;
+    map<string, size_t> property_index;
+    // type of the items of the arrays, not set if all arrays were empty
+    std::unique_ptr<inferred_type> items;
+
+    size_t property(const char *str, SizeType length)
+    {
+        auto it = property_index.find(string(str, length));
+        if (it != property_index.end())
+        {
+            return it->second;
+        }
+        property_index.emplace(string(str, length), names.size());
+        names.emplace_back(str, length);
+        properties.emplace_back();
+        return properties.size() - 1;
+    }
+    // add the values of another part of the input behind the ones of this part
+    void merge(inferred_type &other)
+    {
+        kinds |= other.kinds;
+        count += other.count;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+        above_int64 = above_int64 || other.above_int64;
+        dates = dates && other.dates;
+        date_times = date_times && other.date_times;
+        times = times && other.times;
+        objects += other.objects;
+        for (size_t i = 0; i < other.names.size(); i++)
+        {
+            properties[property(other.names[i].c_str(), other.names[i].size())].merge(other.properties[i]);
+        }
+        if (other.items && items)
+        {
+            items->merge(*other.items);
+        }
+        else if (other.items)
+        {
+            items = std::move(other.items);
+        }
+    }
+};
+
+// collects the values of the rows into their inferred types, stops after max_rows rows if it is not 0
+struct infer_handler : public BaseReaderHandler<UTF8<>, infer_handler>
+{
+    struct open_value
+    {
+        inferred_type *type;
+        bool object;
+        // position of the next key in the properties, rows mostly have their keys in the same order
+        size_t next_key;
+    };
+    inferred_type *rows;
+    // the rows of a JSON (not NDJSON) input are the items of one array
+    const bool rows_in_array;
+    const uint64_t max_rows;
+    uint64_t row_count = 0;
+    bool in_root_array = false;
+    vector<open_value> stack;
+    // type of the value of the last key
+    inferred_type *property = nullptr;
+    // why the input does not fit a schema, nullptr if it was a parse error or the rows were enough
+    const char *error = nullptr;
+
+    infer_handler(inferred_type *rows, bool rows_in_array, uint64_t max_rows) : rows(rows), rows_in_array(rows_in_array), max_rows(max_rows) {}
+
+    inferred_type *add(uint32_t kind)
+    {
+        inferred_type *type;
+        if (stack.empty())
+        {
+            if (rows_in_array && !in_root_array)
+            {
+                error = "a JSON input has to be one array of rows";
+                return nullptr;
+            }
+            if (kind != inferred_type::object_kind)
+            {
+                error = "rows have to be objects";
+                return nullptr;
+            }
+            type = rows;
+        }
+        else if (stack.back().object)
+        {
+            type = property;
+        }
+        else
+        {
+            inferred_type &array = *stack.back().type;
+            if (!array.items)
+            {
+                array.items.reset(new inferred_type());
+            }
+            type = array.items.get();
+        }
+        type->kinds |= kind;
+        type->count++;
+        return type;
+    }
+    bool integer(int64_t i)
+    {
+        inferred_type *type = add(inferred_type::integer_kind);
+        if (type == nullptr)
+        {
+            return false;
+        }
+        type->minimum = std::min(type->minimum, i);
+        type->maximum = std::max(type->maximum, i);
+        return true;
+    }
+    bool Null()
+    {
+        return add(inferred_type::null_kind) != nullptr;
+    }
+    bool Bool(bool b)
+    {
+        return add(inferred_type::boolean_kind) != nullptr;
+    }
+    bool Int(int i)
+    {
+        return integer(i);
+    }
+    bool Uint(unsigned u)
+    {
+        return integer(u);
+    }
+    bool Int64(int64_t i)
+    {
+        return integer(i);
+    }
+    bool Uint64(uint64_t u)
+    {
+        if (u <= INT64_MAX)
+        {
+            return integer(static_cast<int64_t>(u));
+        }
+        inferred_type *type = add(inferred_type::integer_kind);
+        if (type == nullptr)
+        {
+            return false;
+        }
+        type->above_int64 = true;
+        return true;
+    }
+    bool Double(double d)
+    {
+        return add(inferred_type::number_kind) != nullptr;
+    }
+    bool String(const char *str, SizeType length, bool copy)
+    {
+        inferred_type *type = add(inferred_type::string_kind);
+        if (type == nullptr)
+        {
+            return false;
+        }
+        // the formats are checked with the parsers of the conversion, until one string does not fit
+        if (type->dates)
+        {
+            // only the strict YYYY-MM-DD form is a date here, parseDate also takes single digit months and days
+            // and ignores what follows the date, a date-time is no date here
+            int32_t days;
+            type->dates = length == 10 && str[4] == '-' && str[7] == '-' &&
+                          std::all_of(str, str + 10, [](char c)
+                                      { return c == '-' || (c >= '0' && c <= '9'); }) &&
+                          parseDate(str, length, &days);
+        }
+        if (type->date_times)
+        {
+            int64_t timestamp;
+            type->date_times = parseTimestamp(str, length, 1000000, &timestamp);
+        }
+        if (type->times)
+        {
+            int64_t time;
+            type->times = parseTime(str, length, 1000000, &time);
+        }
+        return true;
+    }
+    bool StartObject()
+    {
+        inferred_type *type = add(inferred_type::object_kind);
+        if (type == nullptr)
+        {
+            return false;
+        }
+        type->objects++;
+        stack.push_back({type, true, 0});
+        return true;
+    }
+    bool Key(const char *str, SizeType length, bool copy)
+    {
+        open_value &object = stack.back();
+        inferred_type &type = *object.type;
+        size_t index = object.next_key;
+        if (index >= type.names.size() || type.names[index].size() != length || memcmp(type.names[index].data(), str, length) != 0)
+        {
+            index = type.property(str, length);
+        }
+        object.next_key = index + 1;
+        property = &type.properties[index];
+        return true;
+    }
+    bool EndObject(SizeType memberCount)
+    {
+        stack.pop_back();
+        if (stack.empty())
+        {
+            row_count++;
+            // stop the reader, the rows are enough
+            return max_rows == 0 || row_count < max_rows;
+        }
+        return true;
+    }
+    bool StartArray()
+    {
+        if (stack.empty() && rows_in_array && !in_root_array)
+        {
+            in_root_array = true;
+            return true;
+        }
+        inferred_type *type = add(inferred_type::array_kind);
+        if (type == nullptr)
+        {
+            return false;
+        }
+        stack.push_back({type, false, 0});
+        return true;
+    }
+    bool EndArray(SizeType elementCount)
+    {
+        if (stack.empty())
+        {
+            in_root_array = false;
+            return true;
+        }
+        stack.pop_back();
+        return true;
+    }
+};
+
+// write the JSON schema of an inferred type, `path` is its dot path in the Parquet schema
+// returns why the values do not fit one column, "" if they do
+template <typename JSONWriter>
+static string writeInferredType(JSONWriter &writer, const inferred_type &type, const string &path, bool is_items)
+{
+    string place = path.empty() ? "the rows" : "'" + path + "'";
+    uint32_t kinds = type.kinds & ~inferred_type::null_kind;
+    // integers and numbers are both stored as DOUBLE, so are integers that neither fit INT64 nor UINT64
+    if (kinds == (inferred_type::integer_kind | inferred_type::number_kind) ||
+        (kinds == inferred_type::integer_kind && type.above_int64 && type.minimum < 0))
+    {
+        kinds = inferred_type::number_kind;
+    }
+    bool nullable = (type.kinds & inferred_type::null_kind) != 0;
+    const char *name;
+    switch (kinds)
+    {
+    case 0:
+        // only nulls or empty arrays, nothing tells the type
+        name = "string";
+        break;
+    case inferred_type::boolean_kind:
+        name = "boolean";
+        break;
+    case inferred_type::integer_kind:
+        name = "integer";
+        break;
+    case inferred_type::number_kind:
+        name = "number";
+        break;
+    case inferred_type::string_kind:
+        name = "string";
+        break;
+    case inferred_type::array_kind:
+        name = "array";
+        break;
+    case inferred_type::object_kind:
+        name = "object";
+        break;
+    default:
+        return place + " has values of different types";
+    }
+    if (nullable && is_items && (kinds == inferred_type::array_kind || kinds == inferred_type::object_kind))
+    {
+        return place + " has null items in a list of " + name + "s";
+    }
+    if (kinds == inferred_type::object_kind && type.names.empty())
+    {
+        return place + " only has empty objects";
+    }
+
+    writer.StartObject();
+    writer.Key("type");
+    if (nullable)
+    {
+        writer.StartArray();
+        writer.String(name);
+        writer.String("null");
+        writer.EndArray();
+    }
+    else
+    {
+        writer.String(name);
+    }
+    if (kinds == inferred_type::string_kind && (type.dates || type.date_times || type.times))
+    {
+        writer.Key("format");
+        writer.String(type.dates ? "date" : type.date_times ? "date-time" : "time");
+    }
+    else if (kinds == inferred_type::integer_kind)
+    {
+        // the bounds of the narrowest column type the values fit, createNode picks it from them
+        // values outside of them can not be stored, so they are no tighter than the type itself
+        if (type.above_int64)
+        {
+            writer.Key("minimum");
+            writer.Uint64(0);
+            writer.Key("maximum");
+            writer.Uint64(UINT64_MAX);
+        }
+        else if (type.minimum >= INT32_MIN && type.maximum <= INT32_MAX)
+        {
+            writer.Key("minimum");
+            writer.Int64(INT32_MIN);
+            writer.Key("maximum");
+            writer.Int64(INT32_MAX);
+        }
+        else if (type.minimum >= 0 && type.maximum <= UINT32_MAX)
+        {
+            writer.Key("minimum");
+            writer.Uint64(0);
+            writer.Key("maximum");
+            writer.Uint64(UINT32_MAX);
+        }
+        // other integers are INT64, the default
+    }
+    else if (kinds == inferred_type::array_kind)
+    {
+        const inferred_type no_items;
+        writer.Key("items");
+        string error = writeInferredType(writer, type.items ? *type.items : no_items, path + ".list.element", true);
+        if (!error.empty())
+        {
+            return error;
+        }
+    }
+    else if (kinds == inferred_type::object_kind)
+    {
+        writer.Key("properties");
+        writer.StartObject();
+        for (size_t i = 0; i < type.names.size(); i++)
+        {
+            writer.Key(type.names[i].c_str(), static_cast<SizeType>(type.names[i].size()));
+            string error = writeInferredType(writer, type.properties[i], path.empty() ? type.names[i] : path + "." + type.names[i], false);
+            if (!error.empty())
+            {
+                return error;
+            }
+        }
+        writer.EndObject();
+        vector<size_t> required;
+        for (size_t i = 0; i < type.names.size(); i++)
+        {
+            if (type.properties[i].count >= type.objects && !(type.properties[i].kinds & inferred_type::null_kind))
+            {
+                required.push_back(i);
+            }
         }
-        else
+        if (!required.empty())
         {
-            fields.push_back(createNode(member_key, &member_value, false));
+            writer.Key("required");
+            writer.StartArray();
+            for (size_t i : required)
+            {
+                writer.String(type.names[i].c_str(), static_cast<SizeType>(type.names[i].size()));
+            }
+            writer.EndArray();
         }
     }
-
-    // Create a GroupNode named 'schema' using the primitive nodes defined above
-    // This GroupNode is the root node of the schema tree
-    std::shared_ptr<parquet::schema::Node> root = GroupNode::Make("schema", Repetition::REQUIRED, fields);
-
-    std::shared_ptr<GroupNode> group_root = std::static_pointer_cast<GroupNode>(root);
-
-    // go through complete schema and build global_leaf_indices
-    map<string, int> leaf_indices;
-    buildLeafIndexMap(group_root, &leaf_indices);
-
-    return {group_root, leaf_indices};
+    writer.EndObject();
+    return "";
 }
 
-int parseJSONToParquet(string path, SchemaDocument *json_schema, string parquet_name, std::shared_ptr<parquet::WriterProperties> writer_props, int buffersize = 65536, bool logs = false, bool novalidate = false, bool print_duration = false)
+// error of a reader or handler that stopped before the end of the input, "" if the rows were enough
+static string inferError(const Reader &reader, const infer_handler &handler, const string &path, size_t offset)
 {
-    int16_t glob_new_array_depth = 0;
-    int16_t glob_required_count = 0;
-    int16_t glob_repeated_count = 0;
-    global_required_count = glob_required_count;
-    global_repeated_count = glob_repeated_count;
-    global_new_array_depth = glob_new_array_depth;
-
-    int num_columns = global_leaf_indices->size();
-    column parquet_data[num_columns];
-    global_parquet_data = &parquet_data;
-
-    vector<string> current_keys;
-    global_current_keys = &current_keys;
-
-    vector<int> found_keys;
-    global_found_keys = &found_keys;
-
-    set<string> defined_keys;
-    global_defined_keys = &defined_keys;
-
-    map<string, set<string>> def_keys_per_object;
-    global_def_keys_per_object = &def_keys_per_object;
-
-    map<string, set<string>> def_keys_per_object_individual;
-    global_def_keys_per_object_individual = &def_keys_per_object_individual;
-
-    global_new_object = false;
-    global_new_array = false;
-    global_new_key = false;
-
-    FILE *file = fopen(path.c_str(), "r");
-
-    if (!file)
+    if (!reader.HasParseError() || (handler.max_rows > 0 && handler.row_count >= handler.max_rows))
     {
-        auto now = std::chrono::system_clock::now();
-        ostringstream oss;
-        oss << now << ": CANNOT open file: '" << path << "'" << "\n";
-        string log = oss.str();
-        fmt::print(log);
-        if (logfile->is_open())
-        {
-            (*logfile) << log;
-        }
-        return -1;
+        return "";
     }
-
-    char readBuffer[buffersize];
-    rapidjson::FileReadStream readStream(file, readBuffer, sizeof(readBuffer));
-    MyHandler handler;
-    Reader handlerReader;
-
-    // Setup Parquet writer
-    // Create a local file output stream instance.
-    std::shared_ptr<arrow::io::FileOutputStream> out_file;
-
-    PARQUET_ASSIGN_OR_THROW(out_file, arrow::io::FileOutputStream::Open(parquet_name));
-
-    // Create a ParquetFileWriter instance
-    std::shared_ptr<parquet::ParquetFileWriter> file_writer =
-        parquet::ParquetFileWriter::Open(out_file, (*global_parquet_schema), writer_props);
-    // Append a RowGroup
-    parquet::RowGroupWriter *rg_writer = file_writer->AppendBufferedRowGroup();
-
-    global_file_writer = &file_writer;
-    global_rg_writer = rg_writer;
-    global_row_count = 0;
-    global_total_row_count = 0;
-    global_logs = logs;
-
-    vector<uint64_t> buffered_values_estimate(num_columns, 0);
-    global_buffered_values_estimate = &buffered_values_estimate;
-
-    auto now = std::chrono::system_clock::now();
-    auto start = now;
-    stringstream oss;
-    oss << now << ": START Parsing \"" << path << "\"" << "\n";
-    string log = oss.str();
-    fmt::print(log);
-    if (logfile->is_open())
+    ostringstream oss;
+    oss << "Error at '" << offset + reader.GetErrorOffset() << "' of \"" << path << "\": ";
+    if (handler.error != nullptr)
     {
-        (*logfile) << log;
+        oss << handler.error;
     }
-    if (novalidate)
+    else
     {
-        handlerReader.Parse(readStream, handler);
+        oss << GetParseError_En(reader.GetParseErrorCode());
     }
-    else
+    return oss.str();
+}
+
+// infer the JSON schema from the first sample_rows rows of the inputs, or from all rows if it is 0
+// the whole of a regular NDJSON file is split into chunks of lines that the threads scan at the same time
+// returns an error, "" if the schema was written to `schema`
+static string inferSchema(const vector<string> &paths, bool ndjson, int threads, uint64_t chunk_size, uint64_t buffersize, uint64_t sample_rows, string *schema)
+{
+    inferred_type rows;
+    uint64_t row_count = 0;
+    for (string path : paths)
     {
-        GenericSchemaValidator<SchemaDocument, MyHandler> validator((*json_schema), handler);
-        // see: https://github.com/pah/rapidjson/blob/master/example/schemavalidator/schemavalidator.cpp
-        // https://rapidjson.org/md_doc_schema.html
-        if (!handlerReader.Parse(readStream, validator) && handlerReader.GetParseErrorCode() == kParseErrorTermination)
+        path.erase(std::remove(path.begin(), path.end(), '\n'), path.cend());
+        boost::algorithm::trim(path);
+        if (path.empty())
         {
-            // Not a valid JSON
-            // When reader.GetParseResult().Code() == kParseErrorTermination,
-            // it may be terminated by:
-            // (1) the validator found that the JSON is invalid according to schema; or
-            // (2) the input stream has I/O error.
-
-            // Check the validation result
-            if (!validator.IsValid())
+            continue;
+        }
+        FILE *file = fopen(path.c_str(), "r");
+        if (!file)
+        {
+            return "CANNOT open file: '" + path + "'";
+        }
+        string error;
+        struct stat file_stat;
+        char *mapped_input = nullptr;
+        size_t mapped_size = 0;
+        if (ndjson && threads > 1 && sample_rows == 0 && fstat(fileno(file), &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+        {
+            void *mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (mapping != MAP_FAILED)
             {
-                // Input JSON is invalid according to the schema
-                StringBuffer sb;
-                validator.GetInvalidSchemaPointer().StringifyUriFragment(sb);
-                now = std::chrono::system_clock::now();
-                oss.str(std::string());
-                oss << now << ": Invalid schema: " << sb.GetString() << "\n";
-                log = oss.str();
-                fmt::print(log);
-                if (logfile->is_open())
-                {
-                    (*logfile) << log;
-                }
-                oss.str(std::string());
-                oss << now << ": Invalid keyword: " << validator.GetInvalidSchemaKeyword() << "\n";
-                log = oss.str();
-                fmt::print(log);
-                if (logfile->is_open())
-                {
-                    (*logfile) << log;
-                }
-                sb.Clear();
-                validator.GetInvalidDocumentPointer().StringifyUriFragment(sb);
-                oss.str(std::string());
-                oss << now << ": Invalid document: " << sb.GetString() << "\n";
-                log = oss.str();
-                fmt::print(log);
-                if (logfile->is_open())
-                {
-                    (*logfile) << log;
-                }
+                mapped_input = static_cast<char *>(mapping);
+                mapped_size = file_stat.st_size;
             }
         }
+        if (mapped_input != nullptr)
+        {
+            // chunks end at the end of a line like in parseChunks, each one has its own types that are merged in input order
+            vector<pair<size_t, size_t>> chunks;
+            size_t begin = 0;
+            while (begin < mapped_size)
+            {
+                size_t end = std::min<uint64_t>(mapped_size, begin + std::max<uint64_t>(1, chunk_size));
+                const char *newline = end < mapped_size ? static_cast<const char *>(memchr(mapped_input + end, '\n', mapped_size - end)) : nullptr;
+                end = newline ? newline - mapped_input : mapped_size;
+                chunks.push_back({begin, end - begin});
+                begin = end + 1;
+            }
+            vector<inferred_type> chunk_rows(chunks.size());
+            vector<string> chunk_errors(chunks.size());
+            vector<uint64_t> chunk_row_counts(chunks.size(), 0);
+            parallelFor(chunks.size(), threads, [&](int i)
+                        {
+                infer_handler handler(&chunk_rows[i], false, 0);
+                row_reader reader;
+                skipping_stream chunkStream(mapped_input + chunks[i].first, chunks[i].second);
+                parseDocuments<kParseDefaultFlags>(reader, chunkStream, handler, true);
+                chunk_errors[i] = inferError(reader, handler, path, chunks[i].first);
+                chunk_row_counts[i] = handler.row_count; });
+            munmap(mapped_input, mapped_size);
+            for (size_t i = 0; i < chunks.size() && error.empty(); i++)
+            {
+                error = chunk_errors[i];
+                rows.merge(chunk_rows[i]);
+                row_count += chunk_row_counts[i];
+            }
+        }
+        else
+        {
+            infer_handler handler(&rows, !ndjson, sample_rows > 0 ? sample_rows - row_count : 0);
+            row_reader reader;
+            std::unique_ptr<char[]> readBuffer(new char[buffersize]);
+            rapidjson::FileReadStream readStream(file, readBuffer.get(), buffersize);
+            parseDocuments<kParseDefaultFlags>(reader, readStream, handler, ndjson);
+            error = inferError(reader, handler, path, 0);
+            row_count += handler.row_count;
+        }
+        fclose(file);
+        if (!error.empty())
+        {
+            return error;
+        }
+        if (sample_rows > 0 && row_count >= sample_rows)
+        {
+            break;
+        }
+    }
+    if (row_count == 0)
+    {
+        return "There are no rows";
     }
 
-    fclose(file);
-    file_writer->Close();
-
-    if (handlerReader.HasParseError())
+    // NDJSON rows are validated against the object schema of one row directly
+    StringBuffer buffer;
+    PrettyWriter<StringBuffer> writer(buffer);
+    string error;
+    if (ndjson)
     {
-        now = std::chrono::system_clock::now();
-        oss.str(std::string());
-        oss << now << ": Error at '" << handlerReader.GetErrorOffset() << "': " << GetParseError_En(handlerReader.GetParseErrorCode()) << "\n";
-        log = oss.str();
-        fmt::print(log);
-        if (logfile->is_open())
-        {
-            (*logfile) << log;
-        }
-        return -1;
+        error = writeInferredType(writer, rows, "", false);
     }
-    now = std::chrono::system_clock::now();
-    auto finish = now;
-    oss.str(std::string());
-    oss << now << ": FINISH Parsing" << "\n";
-    log = oss.str();
-    fmt::print(log);
-    if (logfile->is_open())
+    else
     {
-        (*logfile) << log;
+        writer.StartObject();
+        writer.Key("type");
+        writer.String("array");
+        writer.Key("items");
+        error = writeInferredType(writer, rows, "", false);
+        writer.EndObject();
     }
-    if (logs || print_duration)
+    if (!error.empty())
     {
-        auto duration = chrono::duration_cast<chrono::milliseconds>(finish - start);
-        now = std::chrono::system_clock::now();
-        oss.str(std::string());
-        oss << now << ": Duration: " << duration << "\n";
-        log = oss.str();
-        fmt::print(log);
-        if (logfile->is_open())
-        {
-            (*logfile) << log;
-        }
+        return error;
     }
-    return 0;
+    schema->assign(buffer.GetString(), buffer.GetSize());
+    auto now = std::chrono::system_clock::now();
+    ostringstream oss;
+    oss << now << ": INFERRED the schema from " << row_count << " rows" << "\n";
+    fmt::print(oss.str());
+    return "";
 }
 
 parquet::Compression::type getCompression(string compression)
@@ -1600,22 +5159,45 @@ int main(int argc, const char *argv[])
     bool logs = false;
     bool nodictionary = false;
     bool novalidate = false;
+    bool generic_validation = false;
+    bool dead_letter = false;
+    vector<string> columns;
+    string where = "";
+    bool infer = false;
+    string infer_output = "";
+    bool overwrite_schema = false;
+    uint64_t sample_rows = 0;
     bool print_duration = false;
+    bool mmap_input = false;
+    bool insitu = false;
+    bool ndjson = false;
+    int threads = 1;
+    int jobs = 1;
+    uint64_t chunk_size = 64 * 1024 * 1024; // 67108864 -> 64 MB
+    bool pipeline = false;
+    int column_threads = 1;
+    uint64_t memory_limit = 0;
     string logs_name = "";
     uint64_t buffersize = 65536;
 
-    // one row will be kept in memory!
+    // one row will be kept in memory, up to ROW_FLUSH_SIZE bytes of it
     // max number of rows in row group, can be less
     uint64_t NUM_ROWS_PER_ROW_GROUP = 1000000;
     // max bytes in row group, except when one row has more bytes -> this row own row group
     uint64_t ROW_GROUP_SIZE = 1 * 1024 * 1024 * 1024; // 1073741824 -> 1 GB
+    // rows are buffered and handed to the column writers in batches
+    uint64_t BATCH_SIZE = 4096;
+    uint64_t BATCH_BYTE_SIZE = 64 * 1024 * 1024; // 67108864 -> 64 MB
+    // a larger row is handed to the column writers in parts instead of being kept in memory
+    uint64_t ROW_FLUSH_SIZE = 64 * 1024 * 1024; // 67108864 -> 64 MB
+    parquet::LogicalType::TimeUnit::unit time_unit = parquet::LogicalType::TimeUnit::MICROS;
 
     cxxopts::Options options("nested2Parquet", "This is a parser for nested JSON to Parquet files");
     options.positional_help("[optional args]")
         .show_positional_help();
     options
         .set_tab_expansion()
-        .add_options()("s,schema", "The JSON schema file", cxxopts::value<string>())("o,output", "The output parquet filename, but will be ignored when multiple JSON files are given", cxxopts::value<string>())("b,buffer", "The read buffer size. Default: 65536", cxxopts::value<uint64_t>())("r,rows", "The maximum number of rows per row group. Default: 1000000", cxxopts::value<uint64_t>())("z,size", "The maximum number of bytes per row group, except when one single row is larger. Default: 1073741824 (1GB)", cxxopts::value<uint64_t>())("c,compression", "The compression used for the Parquet file. Default: unkompressed. Options are: brotli, bz2, gzip, lz4, lz4_frame, lz4_hadoop, lz0, snappy, zstd, uncompressed", cxxopts::value<string>())("e,encoding", "The default encoding used for the Parquet file. Default: plain. Options are: byte_stream_split, delta_binary_packed, delta_byte_array, delta_length_byte_array, plain, rle, undefined", cxxopts::value<string>())("d,no-dictionary", "Disable dictionary encoding for the Parquet file.", cxxopts::value<bool>()->default_value("false"))("l,logs", "Add a filename here, this will save all logs into the file", cxxopts::value<string>())("u,debug", "Enable additional log outputs while parsing", cxxopts::value<bool>()->default_value("false"))("v,no-validate", "Parse without validating the JSON against the provided schema.", cxxopts::value<bool>()->default_value("false"))("t,duration", "Print the duration at the end of each parsed file. (Also included in debug logs)", cxxopts::value<bool>()->default_value("false"))("positional", "Put the JSON filename(s) here", cxxopts::value<vector<string>>())("h,help", "Print Help");
+        .add_options()("s,schema", "The JSON schema file", cxxopts::value<string>())("o,output", "The output parquet filename, but will be ignored when multiple JSON files are given", cxxopts::value<string>())("b,buffer", "The read buffer size. Default: 65536", cxxopts::value<uint64_t>())("m,mmap", "Read the JSON file(s) through a memory mapping instead of the read buffer. Pipes and other non-regular files are still read through the buffer.", cxxopts::value<bool>()->default_value("false"))("i,insitu", "Parse in situ, strings are referenced in the input instead of copied. Needs memory for the whole input, mapped privately with --mmap or read into one buffer otherwise.", cxxopts::value<bool>()->default_value("false"))("n,ndjson", "The input is newline delimited JSON (JSON Lines) with one row per line instead of one array of rows. Each row is validated against the items of an array schema, or against an object schema directly.", cxxopts::value<bool>()->default_value("false"))("j,jobs", "The number of JSON files converted at the same time when several are given. Default: 1", cxxopts::value<int>())("p,threads", "The number of threads converting one NDJSON file, each shreds its own chunks of lines. The row groups keep the input order. Default: 1", cxxopts::value<int>())("chunk-size", "The number of input bytes per chunk with --threads, extended to the end of the last line. Default: 67108864 (64MB)", cxxopts::value<uint64_t>())("pipeline", "Encode and compress the row batches on a second thread and write the file on a third one while parsing. With --threads only the file is written on its own thread.", cxxopts::value<bool>()->default_value("false"))("column-threads", "The number of threads encoding and compressing the columns of a batch at the same time. Default: 1", cxxopts::value<int>())("memory-limit", "The maximum number of bytes allocated for buffered rows, row groups being written and pending file output of all files converted at the same time. Parsing waits while batches and file output handed to other threads are written, batches and row groups are only written early when that does not help. The input itself is not counted. Default: no limit", cxxopts::value<uint64_t>())("r,rows", "The maximum number of rows per row group. Default: 1000000", cxxopts::value<uint64_t>())("z,size", "The maximum number of bytes per row group, except when one single row is larger. Default: 1073741824 (1GB)", cxxopts::value<uint64_t>())("a,batch", "The number of rows buffered before they are written to the column writers. Default: 4096", cxxopts::value<uint64_t>())("batch-size", "The number of buffered bytes after which a batch is written, even if it has less rows. Default: 67108864 (64MB)", cxxopts::value<uint64_t>())("row-flush-size", "The number of buffered bytes of one single row after which its values are written before the row ends, so a huge row does not need to fit into memory. The row stays in one row group. Rows are not written in parts with --dead-letter. With --threads the parts of a row are written right away in the chunk being written, a later chunk keeps them until it is its turn, as far as --memory-limit allows. Default: 67108864 (64MB)", cxxopts::value<uint64_t>())("timestamp-unit", "The unit of columns with format date-time or time. Default: micros. Options are: micros, nanos", cxxopts::value<string>())("c,compression", "The compression used for the Parquet file. Default: unkompressed. Options are: brotli, bz2, gzip, lz4, lz4_frame, lz4_hadoop, lz0, snappy, zstd, uncompressed", cxxopts::value<string>())("e,encoding", "The default encoding used for the Parquet file. Default: plain. Options are: byte_stream_split, delta_binary_packed, delta_byte_array, delta_length_byte_array, plain, rle, undefined", cxxopts::value<string>())("d,no-dictionary", "Disable dictionary encoding for the Parquet file.", cxxopts::value<bool>()->default_value("false"))("l,logs", "Add a filename here, this will save all logs into the file", cxxopts::value<string>())("u,debug", "Enable additional log outputs while parsing", cxxopts::value<bool>()->default_value("false"))("v,no-validate", "Parse without validating the JSON against the provided schema.", cxxopts::value<bool>()->default_value("false"))("generic-validation", "Validate with the generic schema validator of rapidjson even if all keywords of the schema can be checked while shredding. Slower, meant to compare the results of both.", cxxopts::value<bool>()->default_value("false"))("dead-letter", "Leave out the NDJSON rows that fail to parse, validate or convert instead of stopping. Each of them is written with its error to <output>.dead.ndjson and the next line is parsed, so every row has to be on its own line. Each row is kept in memory until it ends, --row-flush-size does not apply.", cxxopts::value<bool>()->default_value("false"))("columns", "Convert only these columns, given by their dot paths in the Parquet schema like a.b,c.list.element.d. A group selects all columns below it. The values of the other keys are skipped without being converted or validated.", cxxopts::value<vector<string>>())("where", "Keep only the rows for which this expression over leaf columns is true, like event.type = 'purchase' AND (price >= 10 OR tag IN ('a', 'b')) AND note IS NOT NULL. Comparisons with null or missing values are not true. Columns in lists can not be used. Once a row can not match any more, the rest of it is skipped. A row is only written in parts with --row-flush-size once it matches.", cxxopts::value<string>())("infer", "Infer the JSON schema from the input instead of reading it from --schema. Types, nullable values, lists, the narrowest integer columns and the formats date, date-time and time are derived from the rows. With --threads all rows of an NDJSON file are scanned in parallel chunks.", cxxopts::value<bool>()->default_value("false"))("infer-output", "Write the schema inferred with --infer to this file. An existing file is not replaced without --overwrite-schema.", cxxopts::value<string>())("overwrite-schema", "Replace an existing --infer-output file.", cxxopts::value<bool>()->default_value("false"))("sample", "The number of rows the schema is inferred from with --infer, rows behind them that do not fit it fail like with any other schema. Default: 0, all rows", cxxopts::value<uint64_t>())("t,duration", "Print the duration at the end of each parsed file. (Also included in debug logs)", cxxopts::value<bool>()->default_value("false"))("positional", "Put the JSON filename(s) here", cxxopts::value<vector<string>>())("h,help", "Print Help");
     options.parse_positional({"positional"});
 
     auto result_options = options.parse(argc, argv);
@@ -1638,6 +5220,42 @@ int main(int argc, const char *argv[])
     {
         buffersize = result_options["buffer"].as<uint64_t>();
     }
+    if (result_options.count("mmap"))
+    {
+        mmap_input = true;
+    }
+    if (result_options.count("insitu"))
+    {
+        insitu = true;
+    }
+    if (result_options.count("ndjson"))
+    {
+        ndjson = true;
+    }
+    if (result_options.count("jobs"))
+    {
+        jobs = std::max(1, result_options["jobs"].as<int>());
+    }
+    if (result_options.count("threads"))
+    {
+        threads = std::max(1, result_options["threads"].as<int>());
+    }
+    if (result_options.count("chunk-size"))
+    {
+        chunk_size = result_options["chunk-size"].as<uint64_t>();
+    }
+    if (result_options.count("pipeline"))
+    {
+        pipeline = true;
+    }
+    if (result_options.count("column-threads"))
+    {
+        column_threads = std::max(1, result_options["column-threads"].as<int>());
+    }
+    if (result_options.count("memory-limit"))
+    {
+        memory_limit = result_options["memory-limit"].as<uint64_t>();
+    }
     if (result_options.count("rows"))
     {
         NUM_ROWS_PER_ROW_GROUP = result_options["rows"].as<uint64_t>();
@@ -1646,6 +5264,30 @@ int main(int argc, const char *argv[])
     {
         ROW_GROUP_SIZE = result_options["size"].as<uint64_t>();
     }
+    if (result_options.count("batch"))
+    {
+        BATCH_SIZE = std::max<uint64_t>(1, result_options["batch"].as<uint64_t>());
+    }
+    if (result_options.count("batch-size"))
+    {
+        BATCH_BYTE_SIZE = result_options["batch-size"].as<uint64_t>();
+    }
+    if (result_options.count("row-flush-size"))
+    {
+        ROW_FLUSH_SIZE = std::max<uint64_t>(1, result_options["row-flush-size"].as<uint64_t>());
+    }
+    if (result_options.count("timestamp-unit"))
+    {
+        string unit = result_options["timestamp-unit"].as<string>();
+        if (unit == "nanos" || unit == "NANOS")
+        {
+            time_unit = parquet::LogicalType::TimeUnit::NANOS;
+        }
+        else if (unit != "micros" && unit != "MICROS")
+        {
+            fmt::println("{}: Unknown timestamp unit '{}', using micros", std::chrono::system_clock::now(), unit);
+        }
+    }
     if (result_options.count("compression"))
     {
         compression = result_options["compression"].as<string>();
@@ -1666,6 +5308,38 @@ int main(int argc, const char *argv[])
     {
         novalidate = true;
     }
+    if (result_options.count("generic-validation"))
+    {
+        generic_validation = true;
+    }
+    if (result_options.count("dead-letter"))
+    {
+        dead_letter = true;
+    }
+    if (result_options.count("columns"))
+    {
+        columns = result_options["columns"].as<vector<string>>();
+    }
+    if (result_options.count("where"))
+    {
+        where = result_options["where"].as<string>();
+    }
+    if (result_options.count("infer"))
+    {
+        infer = true;
+    }
+    if (result_options.count("infer-output"))
+    {
+        infer_output = result_options["infer-output"].as<string>();
+    }
+    if (result_options.count("overwrite-schema"))
+    {
+        overwrite_schema = true;
+    }
+    if (result_options.count("sample"))
+    {
+        sample_rows = result_options["sample"].as<uint64_t>();
+    }
     if (result_options.count("no-dictionary"))
     {
         nodictionary = true;
@@ -1679,6 +5353,37 @@ int main(int argc, const char *argv[])
         paths = result_options["positional"].as<vector<string>>();
     }
 
+    if (threads > 1 && !ndjson)
+    {
+        fmt::println("{}: Only NDJSON input is split between threads, converting with one thread", std::chrono::system_clock::now());
+    }
+    if (infer && schema_path.length() > 0)
+    {
+        // the schema file is an input, it is never written
+        fmt::println("{}: --schema is not read with --infer, write the inferred schema with --infer-output", std::chrono::system_clock::now());
+        return -1;
+    }
+    if (!infer && infer_output.length() > 0)
+    {
+        fmt::println("{}: --infer-output is only written with --infer, ignoring it", std::chrono::system_clock::now());
+    }
+    if (dead_letter && !ndjson)
+    {
+        // the array of a JSON input can not be continued behind a row that failed
+        fmt::println("{}: Only NDJSON rows can be written to the dead letters, converting without --dead-letter", std::chrono::system_clock::now());
+        dead_letter = false;
+    }
+    if (dead_letter && insitu)
+    {
+        fmt::println("{}: --insitu is not used with --dead-letter, the rows that fail are copied from the unchanged input", std::chrono::system_clock::now());
+        insitu = false;
+    }
+    if (dead_letter && result_options.count("row-flush-size"))
+    {
+        // a row that was written in parts could not be taken out again
+        fmt::println("{}: --row-flush-size is not used with --dead-letter, each row is kept in memory until it ends", std::chrono::system_clock::now());
+    }
+
     schema_path.erase(std::remove(schema_path.begin(), schema_path.end(), '\n'), schema_path.cend());
     boost::algorithm::trim(schema_path);
     if (schema_path.length() > 0)
@@ -1692,27 +5397,102 @@ int main(int argc, const char *argv[])
     }
 
     // build schema here and use for every file
-    FILE *schema_file = fopen(schema_path.c_str(), "r");
-
-    if (!schema_file)
+    Document schema_doc;
+    if (infer)
+    {
+        string schema_text;
+        string error = inferSchema(paths, ndjson, threads, chunk_size, buffersize, sample_rows, &schema_text);
+        if (!error.empty())
+        {
+            fmt::println("{}: Can not infer the schema: {}", std::chrono::system_clock::now(), error);
+            return -1;
+        }
+        if (infer_output.length() > 0)
+        {
+            struct stat output_stat;
+            if (!overwrite_schema && stat(infer_output.c_str(), &output_stat) == 0)
+            {
+                fmt::println("{}: The schema file '{}' exists already, replace it with --overwrite-schema", std::chrono::system_clock::now(), infer_output);
+                return -1;
+            }
+            ofstream schema_output(infer_output, ios::trunc);
+            schema_output << schema_text << "\n";
+            if (!schema_output)
+            {
+                fmt::println("{}: CANNOT write schema file: '{}'", std::chrono::system_clock::now(), infer_output);
+                return -1;
+            }
+        }
+        schema_doc.Parse(schema_text.c_str());
+    }
+    else
     {
-        fmt::println("{}: CANNOT open schema file: '{}'", std::chrono::system_clock::now(), schema_path);
+        FILE *schema_file = fopen(schema_path.c_str(), "r");
+
+        if (!schema_file)
+        {
+            fmt::println("{}: CANNOT open schema file: '{}'", std::chrono::system_clock::now(), schema_path);
+            return -1;
+        }
+
+        char schemaReadBuffer[4096];
+        rapidjson::FileReadStream schemaReadStream(schema_file, schemaReadBuffer, sizeof(schemaReadBuffer));
+        schema_doc.ParseStream(schemaReadStream);
         fclose(schema_file);
-        return -1;
     }
+    // NDJSON rows are validated one by one, against the items when the schema describes the whole array
+    bool items_schema = ndjson && schema_doc.IsObject() && schema_doc.HasMember("type") && schemaType(schema_doc["type"]) == "array";
+    SchemaDocument json_schema(schema_doc, nullptr, 0, nullptr, nullptr, items_schema ? Pointer("/items") : Pointer());
 
-    Document schema_doc;
-    char schemaReadBuffer[4096];
-    rapidjson::FileReadStream schemaReadStream(schema_file, schemaReadBuffer, sizeof(schemaReadBuffer));
-    schema_doc.ParseStream(schemaReadStream);
-    SchemaDocument json_schema(schema_doc);
-    fclose(schema_file);
+    // the rows of a JSON input are the items of one array, only NDJSON rows can be described by the object schema of one row
+    if (!ndjson && (!schema_doc.IsObject() || !schema_doc.HasMember("type") || schemaType(schema_doc["type"]) != "array"))
+    {
+        fmt::println("{}: The schema of a JSON input has to be an array of rows, an object schema is only used with --ndjson", std::chrono::system_clock::now());
+        return -1;
+    }
 
     // expect json schema to be given
     // generate Schema for parquet
-    auto schema_tuple = SetupParquetSchema(&schema_doc);
-    global_parquet_schema = &schema_tuple.first;
-    global_leaf_indices = &schema_tuple.second;
+    auto schema_tuple = SetupParquetSchema(&schema_doc, time_unit, columns);
+    conversion_settings settings;
+    settings.parquet_schema = schema_tuple.first;
+    settings.schema_nodes = std::move(schema_tuple.second);
+    for (const string &column : columns)
+    {
+        if (std::none_of(settings.schema_nodes.begin(), settings.schema_nodes.end(), [&](const schema_node &node)
+                         { return node.depth > 0 && node.path == column; }))
+        {
+            fmt::println("{}: Column '{}' is not in the schema", std::chrono::system_clock::now(), column);
+            return -1;
+        }
+    }
+    settings.projection = !columns.empty();
+    if (!where.empty())
+    {
+        string error = compileWhere(where, &settings);
+        if (!error.empty())
+        {
+            fmt::println("{}: Invalid --where expression: {}", std::chrono::system_clock::now(), error);
+            return -1;
+        }
+    }
+    settings.num_columns = std::count_if(settings.schema_nodes.begin(), settings.schema_nodes.end(), [](const schema_node &node)
+                                         { return node.leaf_index >= 0; });
+    // the handler validates while shredding if it knows all keywords of the schema, otherwise the generic validator runs in front of it
+    settings.rows_in_array = !ndjson && schemaType(schema_doc["type"]) == "array";
+    if (!novalidate)
+    {
+        string unsupported = compileSchemaValidation(&schema_doc, &settings.schema_nodes);
+        settings.inline_validation = unsupported.empty() && !generic_validation;
+        if (!settings.inline_validation)
+        {
+            settings.json_schema = &json_schema;
+        }
+        if (!unsupported.empty())
+        {
+            fmt::println("{}: Keyword '{}' of the schema is validated by the generic validator", std::chrono::system_clock::now(), unsupported);
+        }
+    }
 
     // write logs to txt
     ofstream logoutput;
@@ -1773,10 +5553,30 @@ int main(int argc, const char *argv[])
         builder.disable_dictionary();
     }
 
-    auto writer_props = builder.build();
-
-    global_row_group_size = ROW_GROUP_SIZE;
-    global_num_rows_per_row_group = NUM_ROWS_PER_ROW_GROUP;
+    settings.writer_props = builder.build();
+    settings.row_group_size = ROW_GROUP_SIZE;
+    settings.num_rows_per_row_group = NUM_ROWS_PER_ROW_GROUP;
+    settings.batch_size = BATCH_SIZE;
+    settings.batch_byte_size = BATCH_BYTE_SIZE;
+    settings.row_flush_size = ROW_FLUSH_SIZE;
+    settings.buffersize = buffersize;
+    settings.logs = logs;
+    settings.novalidate = novalidate;
+    settings.dead_letter = dead_letter;
+    settings.print_duration = print_duration;
+    settings.mmap_input = mmap_input;
+    settings.insitu = insitu;
+    settings.ndjson = ndjson;
+    settings.threads = threads;
+    settings.chunk_size = chunk_size;
+    settings.pipeline = pipeline;
+    settings.column_threads = column_threads;
+    memory_budget memory;
+    memory.limit = memory_limit;
+    if (memory_limit > 0)
+    {
+        settings.memory = &memory;
+    }
 
     int res = 0;
 
@@ -1789,7 +5589,7 @@ int main(int argc, const char *argv[])
         {
             int lastdot = path.find_last_of('.');
             string ending = path.substr(lastdot + 1, path.length());
-            if (ending != "json")
+            if (ending != "json" && !(ndjson && (ending == "jsonl" || ending == "ndjson")))
             {
                 now = std::chrono::system_clock::now();
                 oss.str(std::string());
@@ -1803,12 +5603,13 @@ int main(int argc, const char *argv[])
             }
             else
             {
-                res = parseJSONToParquet(path, &json_schema, parquet_name, writer_props, buffersize, logs, novalidate, print_duration);
+                res = parseJSONToParquet(path, parquet_name, &settings);
             }
         }
     }
     else
     {
+        vector<string> json_paths;
         for (string path : paths)
         {
             path.erase(std::remove(path.begin(), path.end(), '\n'), path.cend());
@@ -1817,7 +5618,7 @@ int main(int argc, const char *argv[])
             {
                 int lastdot = path.find_last_of('.');
                 string ending = path.substr(lastdot + 1, path.length());
-                if (ending != "json")
+                if (ending != "json" && !(ndjson && (ending == "jsonl" || ending == "ndjson")))
                 {
                     now = std::chrono::system_clock::now();
                     oss.str(std::string());
@@ -1830,20 +5631,30 @@ int main(int argc, const char *argv[])
                     fmt::print(log);
                     continue;
                 }
+                json_paths.push_back(path);
+            }
+        }
+
+        // every worker takes the next file until all are converted, each file has its own writer and handler state
+        std::atomic<size_t> next_path(0);
+        auto convertFiles = [&]()
+        {
+            for (size_t i = next_path++; i < json_paths.size(); i = next_path++)
+            {
+                const string &path = json_paths[i];
                 // ignore parquet_name for multiple JSON files given!
                 string file_name = path.substr(0, path.find_last_of('.'));
-                res = parseJSONToParquet(path, &json_schema, file_name + ".parquet", writer_props, buffersize, logs, novalidate, print_duration);
-                if (res != 0)
+                int file_res = parseJSONToParquet(path, file_name + ".parquet", &settings);
+                if (file_res != 0)
                 {
-                    now = std::chrono::system_clock::now();
-                    oss.str(std::string());
-                    oss << now << ": Error while parsing " << path << "\n";
-                    log = oss.str();
-                    if (logoutput.is_open())
-                    {
-                        logoutput << log;
-                    }
-                    fmt::print(log);
+                    ostringstream error_oss;
+                    error_oss << std::chrono::system_clock::now() << ": Error while parsing " << path << "\n";
+                    printLog(error_oss.str());
+                }
+                std::lock_guard<std::mutex> lock(log_mutex);
+                if (file_res != 0)
+                {
+                    res = file_res;
                 }
                 if (logoutput.is_open())
                 {
@@ -1851,6 +5662,16 @@ int main(int argc, const char *argv[])
                     logoutput.open(logs_name, ios::app);
                 }
             }
+        };
+        vector<std::thread> workers;
+        for (int j = 1; j < jobs; j++)
+        {
+            workers.emplace_back(convertFiles);
+        }
+        convertFiles();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
         }
     }
     if (logoutput.is_open())
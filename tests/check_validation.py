@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# compares the rows rejected by the validation compiled into the handler with the ones rapidjson's
+# generic schema validator rejects, for the same schema and NDJSON rows
+# usage: check_validation.py <path to nested2Parquet>
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+# (name, properties of the row object, required keys, rows)
+CASES = [
+    ("integer bounds", {"n": {"type": "integer", "minimum": 0, "maximum": 10}}, [],
+     [{"n": -1}, {"n": 0}, {"n": 10}, {"n": 11}, {"n": 5}]),
+    ("number bounds", {"x": {"type": "number", "minimum": 0.5, "maximum": 2.5}}, [],
+     [{"x": 0.49}, {"x": 0.5}, {"x": 1}, {"x": 2.5}, {"x": 2.51}]),
+    ("draft 4 exclusive integer", {"n": {"type": "integer", "minimum": 0, "exclusiveMinimum": True, "maximum": 10, "exclusiveMaximum": True}}, [],
+     [{"n": 0}, {"n": 1}, {"n": 9}, {"n": 10}]),
+    ("draft 4 exclusive number", {"x": {"type": "number", "minimum": 0.5, "exclusiveMinimum": True, "maximum": 2.5, "exclusiveMaximum": True}}, [],
+     [{"x": 0.5}, {"x": 0.51}, {"x": 2.49}, {"x": 2.5}]),
+    ("draft 4 not exclusive", {"n": {"type": "integer", "minimum": 0, "exclusiveMinimum": False}}, [],
+     [{"n": -1}, {"n": 0}]),
+    ("numeric exclusiveMinimum", {"n": {"type": "integer", "exclusiveMinimum": 0}}, [],
+     [{"n": -1}, {"n": 0}, {"n": 1}]),
+    ("numeric exclusiveMaximum", {"x": {"type": "number", "exclusiveMaximum": 2.5}}, [],
+     [{"x": 2.4}, {"x": 2.5}, {"x": 2.6}]),
+    ("integer types", {"n": {"type": "integer"}}, [],
+     [{"n": 1}, {"n": 1.5}, {"n": "1"}, {"n": True}, {"n": None}]),
+    ("nullable", {"n": {"type": ["integer", "null"], "minimum": 1}}, [],
+     [{"n": None}, {"n": 0}, {"n": 1}, {}]),
+    ("required", {"r": {"type": "string"}, "o": {"type": "string"}}, ["r"],
+     [{"r": "a"}, {"o": "a"}, {"r": None}, {}]),
+    ("required but null", {"r": {"type": ["string", "null"]}}, ["r"],
+     [{"r": None}, {"r": "a"}, {}]),
+    ("string length", {"s": {"type": "string", "minLength": 2, "maxLength": 3}}, [],
+     [{"s": "a"}, {"s": "ab"}, {"s": "abc"}, {"s": "abcd"}, {"s": "äö"}, {"s": "äöüß"}]),
+    ("enum", {"s": {"type": "string", "enum": ["a", "b"]}}, [],
+     [{"s": "a"}, {"s": "b"}, {"s": "c"}, {"s": ""}]),
+    ("items", {"l": {"type": "array", "items": {"type": "integer", "minimum": 0}, "minItems": 1, "maxItems": 2}}, [],
+     [{"l": []}, {"l": [0]}, {"l": [0, 1]}, {"l": [0, 1, 2]}, {"l": [-1]}, {}]),
+    ("nullable items", {"l": {"type": ["array", "null"], "items": {"type": ["string", "null"]}, "maxItems": 1}}, [],
+     [{"l": None}, {"l": [None]}, {"l": ["a"]}, {"l": ["a", None]}]),
+    ("additionalProperties", {"o": {"type": "object", "properties": {"a": {"type": "integer"}}, "additionalProperties": False}}, [],
+     [{"o": {"a": 1}}, {"o": {"a": 1, "b": 2}}, {"o": {}}]),
+    ("nested required", {"o": {"type": "object", "properties": {"a": {"type": "integer"}, "b": {"type": "integer"}}, "required": ["a"]}}, [],
+     [{"o": {"a": 1}}, {"o": {"b": 1}}, {"o": {"a": None}}, {}]),
+]
+
+
+# exit code and the rows written to the dead letter file
+def rejected(binary, directory, schema_file, rows_file, generic):
+    output = os.path.join(directory, "generic.parquet" if generic else "inline.parquet")
+    command = [binary, "-n", "--dead-letter", "-s", schema_file, "-o", output, rows_file]
+    if generic:
+        command.append("--generic-validation")
+    result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    letters = os.path.splitext(output)[0] + ".dead.ndjson"
+    rows = []
+    if os.path.exists(letters):
+        with open(letters, encoding="utf-8") as file:
+            rows = [json.loads(line)["row"] for line in file if line.strip()]
+        os.remove(letters)
+    return result.returncode, rows
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("usage: check_validation.py <path to nested2Parquet>")
+        return 2
+    binary = sys.argv[1]
+    failures = 0
+    with tempfile.TemporaryDirectory() as directory:
+        for name, properties, required, rows in CASES:
+            schema = {"type": "object", "properties": properties}
+            if required:
+                schema["required"] = required
+            schema_file = os.path.join(directory, "schema.json")
+            rows_file = os.path.join(directory, "rows.json")
+            with open(schema_file, "w") as file:
+                json.dump(schema, file)
+            lines = [json.dumps(row, ensure_ascii=False) for row in rows]
+            with open(rows_file, "w", encoding="utf-8") as file:
+                file.write("\n".join(lines) + "\n")
+
+            inline = rejected(binary, directory, schema_file, rows_file, False)
+            generic = rejected(binary, directory, schema_file, rows_file, True)
+            # a negative exit code is a signal, the conversion crashed
+            if inline == generic and inline[0] >= 0:
+                print("ok   {}: {} of {} rows rejected".format(name, len(inline[1]), len(rows)))
+                continue
+            failures += 1
+            for label, (code, letters) in (("inline", inline), ("generic", generic)):
+                print("FAIL {}: {} exit code {}, rejected {}".format(name, label, code, letters))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())